@@ -3,43 +3,74 @@
 
 #include "utility.h"
 
-class aabb {
+// Axis-aligned box with scalar type T; the renderer uses aabb,
+// basic_aabb<real>.
+template <typename T>
+class basic_aabb {
     public:
-        aabb() {}
-        aabb(const point3& a, const point3& b) { minimum = a; maximum = b;}
+        typedef basic_vec3<T> vector_type;
 
-        point3 min() const {return minimum; }
-        point3 max() const {return maximum; }
+        basic_aabb() {}
+        basic_aabb(const vector_type& a, const vector_type& b) { minimum = a; maximum = b;}
 
-        bool hit(const ray& r, double t_min, double t_max) const {
+        vector_type min() const {return minimum; }
+        vector_type max() const {return maximum; }
+
+        // Slab test using the ray's reciprocal direction. The ray's sign
+        // picks the near and far plane of each axis, so there are no
+        // divisions or swaps. A NaN (zero direction component and a slab
+        // plane through the origin) leaves the interval unchanged, and boxes
+        // that are flat along an axis can still be hit.
+        bool hit(const basic_ray<T>& r, T t_min, T t_max) const {
+            T t_enter;
+            return hit(r, t_min, t_max, t_enter);
+        }
+
+        // Same, and sets t_enter to where the ray enters the box, or t_min
+        // if it starts inside.
+        bool hit(const basic_ray<T>& r, T t_min, T t_max, T& t_enter) const {
             for (int a = 0; a < 3; a++) {
-                auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
-                               (maximum[a] - r.origin()[a]) / r.direction()[a]);
-                auto t1 = fmax((minimum[a] - r.origin()[a]) / r.direction()[a],
-                               (maximum[a] - r.origin()[a]) / r.direction()[a]);
-
-                t_min = fmax(t0, t_min);
-                t_max = fmin(t1, t_max);
-                if (t_max <= t_min)
-                    return false;
+                auto t0 = ((r.sign[a] ? maximum : minimum)[a] - r.orig[a]) * r.inv_dir[a];
+                auto t1 = ((r.sign[a] ? minimum : maximum)[a] - r.orig[a]) * r.inv_dir[a];
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
             }
-            return true;
+            t_enter = t_min;
+            return t_min <= t_max;
+        }
+
+        T surface_area() const {
+            auto d = maximum - minimum;
+            return 2.0 * (d.x()*d.y() + d.y()*d.z() + d.z()*d.x());
         }
 
-        point3 minimum;
-        point3 maximum;
+        vector_type centroid() const {
+            return 0.5 * (minimum + maximum);
+        }
+
+        // A box that contains nothing; growing it by any box gives that box.
+        static basic_aabb empty() {
+            const T inf = std::numeric_limits<T>::infinity();
+            return basic_aabb(vector_type(inf, inf, inf), vector_type(-inf, -inf, -inf));
+        }
+
+        vector_type minimum;
+        vector_type maximum;
 };
 
-aabb surrounding_box(aabb box0, aabb box1) {
-    point3 small(fmin(box0.min().x(), box1.min().x()),
-                 fmin(box0.min().y(), box1.min().y()),
-                 fmin(box0.min().z(), box1.min().z()));
+typedef basic_aabb<real> aabb;
+
+template <typename T>
+basic_aabb<T> surrounding_box(basic_aabb<T> box0, basic_aabb<T> box1) {
+    basic_vec3<T> small(fmin(box0.min().x(), box1.min().x()),
+                        fmin(box0.min().y(), box1.min().y()),
+                        fmin(box0.min().z(), box1.min().z()));
 
-    point3 big(fmax(box0.max().x(), box1.max().x()),
-               fmax(box0.max().y(), box1.max().y()),
-               fmax(box0.max().z(), box1.max().z()));
+    basic_vec3<T> big(fmax(box0.max().x(), box1.max().x()),
+                      fmax(box0.max().y(), box1.max().y()),
+                      fmax(box0.max().z(), box1.max().z()));
 
-    return aabb(small,big);
+    return basic_aabb<T>(small,big);
 }
 
 #endif
@@ -11,21 +11,24 @@ class xy_rect : public hittable {
         xy_rect() {}
 
         xy_rect(
-            double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat
+            real _x0, real _x1, real _y0, real _y1, real _k, shared_ptr<material> mat
         ) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_data& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual void surface(const ray& r, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
             // dimension a small amount.
-            output_box = aabb(point3(x0,y0, k-0.0001), point3(x1, y1, k+0.0001));
+            const auto pad = scalar_traits<real>::box_padding();
+            output_box = aabb(point3(x0,y0, k-pad), point3(x1, y1, k+pad));
             return true;
         }
 
     public:
         shared_ptr<material> mp;
-        double x0, x1, y0, y1, k;
+        real x0, x1, y0, y1, k;
 };
 
 class xz_rect : public hittable {
@@ -33,21 +36,24 @@ class xz_rect : public hittable {
         xz_rect() {}
 
         xz_rect(
-            double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat
+            real _x0, real _x1, real _z0, real _z1, real _k, shared_ptr<material> mat
         ) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_data& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual void surface(const ray& r, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
             // dimension a small amount.
-            output_box = aabb(point3(x0,k-0.0001,z0), point3(x1, k+0.0001, z1));
+            const auto pad = scalar_traits<real>::box_padding();
+            output_box = aabb(point3(x0,k-pad,z0), point3(x1, k+pad, z1));
             return true;
         }
 
     public:
         shared_ptr<material> mp;
-        double x0, x1, z0, z1, k;
+        real x0, x1, z0, z1, k;
 };
 
 class yz_rect : public hittable {
@@ -55,24 +61,27 @@ class yz_rect : public hittable {
         yz_rect() {}
 
         yz_rect(
-            double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat
+            real _y0, real _y1, real _z0, real _z1, real _k, shared_ptr<material> mat
         ) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_data& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual void surface(const ray& r, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
             // dimension a small amount.
-            output_box = aabb(point3(k-0.0001, y0, z0), point3(k+0.0001, y1, z1));
+            const auto pad = scalar_traits<real>::box_padding();
+            output_box = aabb(point3(k-pad, y0, z0), point3(k+pad, y1, z1));
             return true;
         }
 
     public:
         shared_ptr<material> mp;
-        double y0, y1, z0, z1, k;
+        real y0, y1, z0, z1, k;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
     auto t = (k-r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max)
         return false;
@@ -83,16 +92,18 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_data& rec) const
         return false;
 
 
-    rec.t = t;
+    rec.set_hit(t, this);
+    return true;
+}
+
+void xy_rect::surface(const ray& r, hit_data& rec) const {
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.material_pointer = mp;
-    rec.hit_point = r.at(t);
-
-    return true;
+    rec.material_pointer = mp.get();
+    rec.hit_point = r.at(rec.t);
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
     auto t = (k-r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -103,16 +114,18 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_data& rec) const
         return false;
 
 
-    rec.t = t;
+    rec.set_hit(t, this);
+    return true;
+}
+
+void xz_rect::surface(const ray& r, hit_data& rec) const {
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.material_pointer = mp;
-    rec.hit_point = r.at(t);
-
-    return true;
+    rec.material_pointer = mp.get();
+    rec.hit_point = r.at(rec.t);
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
     auto t = (k-r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -123,13 +136,15 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_data& rec) const
         return false;
 
 
-    rec.t = t;
+    rec.set_hit(t, this);
+    return true;
+}
+
+void yz_rect::surface(const ray& r, hit_data& rec) const {
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.material_pointer = mp;
-    rec.hit_point = r.at(t);
-
-    return true;
+    rec.material_pointer = mp.get();
+    rec.hit_point = r.at(rec.t);
 }
 
 #endif
@@ -0,0 +1,88 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "hittable_list.h"
+#include "parallel.h"
+
+#include <chrono>
+#include <iostream>
+#include <sys/resource.h>
+
+// Peak resident set size of the process so far, in bytes.
+size_t peak_memory_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+// Builds one of the pointer-free layouts and reports its cost and size.
+template <typename bvh_type>
+shared_ptr<hittable> build_flat_bvh(
+    const hittable_list& objects, const bvh_build_options& options, double time0, double time1,
+    double& cost, size_t& node_count
+) {
+    auto bvh = make_shared<bvh_type>(objects, options, time0, time1);
+    cost = bvh->tree.sah_cost();
+    node_count = bvh->tree.nodes.size();
+    return bvh;
+}
+
+// Builds a BVH over objects with the chosen layout and split method, and
+// reports its SAH cost, build time and the peak memory use of the process so
+// that builders can be compared.
+shared_ptr<hittable> build_bvh(
+    const hittable_list& objects, const bvh_build_options& options,
+    double time0 = 0.0, double time1 = 1.0
+) {
+    auto started = std::chrono::steady_clock::now();
+    shared_ptr<hittable> root;
+    double cost = 0;
+    size_t node_count = 0;
+
+    const char* layout_name = "tree";
+
+    switch (options.layout) {
+        case bvh_layout::flat:
+            root = build_flat_bvh<flat_bvh>(objects, options, time0, time1, cost, node_count);
+            layout_name = "flat";
+            break;
+        case bvh_layout::wide4:
+            root = build_flat_bvh<wide4_bvh>(objects, options, time0, time1, cost, node_count);
+            layout_name = "wide4";
+            break;
+        case bvh_layout::wide8:
+            root = build_flat_bvh<wide8_bvh>(objects, options, time0, time1, cost, node_count);
+            layout_name = "wide8";
+            break;
+        default: {
+            auto prims = make_bvh_primitives(objects.objects, time0, time1, options.threads);
+            auto node = make_shared<bvh_node>(objects.objects, prims, 0, prims.size(), options);
+            cost = node->sah_cost();
+            root = node;
+            break;
+        }
+    }
+
+    std::cerr << "BVH (" << layout_name << ", "
+              << (options.split == bvh_split::median ? "median" : "sah") << "): "
+              << objects.objects.size() << " primitives";
+    if (node_count > 0)
+        std::cerr << ", " << node_count << " nodes";
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+    std::cerr << ", SAH cost " << cost << "\n"
+              << "BVH built in " << elapsed.count() << " ms with " << worker_count(options.threads)
+              << " threads, peak memory " << peak_memory_bytes() / (1024.0 * 1024.0) << " MB\n";
+    return root;
+}
+
+#endif
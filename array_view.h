@@ -0,0 +1,42 @@
+#ifndef ARRAY_VIEW_H
+#define ARRAY_VIEW_H
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Read-only array whose elements live either in a vector it owns or in
+// memory that belongs to someone else, such as a memory-mapped file, which
+// owner keeps alive for as long as any copy of the view exists. Copies share
+// the elements.
+template <typename T>
+class array_view {
+    public:
+        array_view() {}
+
+        array_view(std::vector<T> elements) {
+            auto storage = std::make_shared<std::vector<T>>(std::move(elements));
+            first = storage->data();
+            count = storage->size();
+            owner = storage;
+        }
+
+        array_view(const T* elements, size_t size, std::shared_ptr<const void> keep_alive)
+            : first(elements), count(size), owner(std::move(keep_alive)) {}
+
+        const T* data() const { return first; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        const T& operator[](size_t i) const { return first[i]; }
+        const T* begin() const { return first; }
+        const T* end() const { return first + count; }
+
+    private:
+        const T* first = nullptr;
+        size_t count = 0;
+        std::shared_ptr<const void> owner;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "image_io.h"
+#include "progressive.h"
+#include "triangle.h"
+#include "wide_bvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <vector>
+
+// Traversal throughput
+
+// Closest-hit queries per second over rays, best of three runs on one thread.
+// hits is set to the number of rays that hit something. With any_hit, the
+// queries are occluded() instead.
+double measure_traversal(const hittable& world, const std::vector<ray>& rays, size_t& hits, bool any_hit = false) {
+    using clock = std::chrono::steady_clock;
+    double best = 0;
+    for (int run = 0; run < 3; ++run) {
+        hits = 0;
+        auto started = clock::now();
+        for (const auto& r : rays) {
+            hit_data data;
+            if (any_hit ? world.occluded(r, min_hit_distance(r), infinity)
+                        : world.hit(r, min_hit_distance(r), infinity, data))
+                ++hits;
+        }
+        std::chrono::duration<double> elapsed = clock::now() - started;
+        best = std::max(best, rays.size() / elapsed.count());
+    }
+    return best;
+}
+
+// Measures how fast world answers closest-hit queries for camera rays and for
+// the diffuse bounce rays leaving their hit points, which are less coherent,
+// and any-hit queries for the bounce rays, as shadow rays would make them.
+// The rays are made up front so only hit() and occluded() are timed.
+void run_traversal_benchmark(const hittable& world, const camera& cam, int ray_count) {
+    std::vector<ray> primary;
+    std::vector<ray> secondary;
+    primary.reserve(ray_count);
+    for (int k = 0; k < ray_count; ++k) {
+        seed_sample(k, 0);
+        primary.push_back(cam.get_ray(random_double(), random_double()));
+    }
+    for (const auto& r : primary) {
+        hit_data data;
+        if (hit_surface(world, r, min_hit_distance(r), infinity, data))
+            secondary.push_back(ray(data.hit_point, data.hit_normal + random_unit_vector()));
+    }
+
+    const std::vector<ray>* sets[3] = {&primary, &secondary, &secondary};
+    const char* names[3] = {"primary", "secondary", "secondary occluded()"};
+    for (int k = 0; k < 3; ++k) {
+        size_t hits = 0;
+        report_traversal_stats(names[k], false);
+        double rate = measure_traversal(world, *sets[k], hits, k == 2);
+        std::cerr << names[k] << " rays (" << sizeof(real) * 8 << "-bit): " << sets[k]->size() << ", "
+                  << 100.0 * hits / std::max<size_t>(sets[k]->size(), 1) << "% hit, "
+                  << rate / 1e6 << " Mrays/s\n";
+        report_traversal_stats(names[k]);
+    }
+}
+
+// Layout agreement
+
+// The wide layouts test boxes in single precision, so they must never cull a
+// box that the flat tree enters. Builds the three layouts, with one triangle
+// per leaf, over folds of two axis-aligned triangles meeting at a right angle
+// around centers far from the world origin. Rays leave one side of a fold a
+// few thousandths from the edge and hit the other side, whose leaf box has no
+// thickness, right away; others leave a triangle in a random direction. Every
+// ray must get the same closest hit, and be occluded, in all three layouts.
+// Prints the number of disagreements per layout.
+bool check_bvh_layouts(int ray_count, bvh_build_options options) {
+    const point3 centers[3] = {point3(0, 0, 0), point3(450, 450, 100), point3(30000, -20000, 50000)};
+    const int fold_count = 1000;
+    const char* names[2] = {"wide4", "wide8"};
+    bool agree = true;
+
+    for (const auto& center : centers) {
+        hittable_list objects;
+        std::vector<point3> edges;
+        seed_sample(0, 0);
+        for (int k = 0; k < fold_count; ++k) {
+            point3 c = center + 200 * vec3::random(-1, 1);
+            auto s = random_double(0.5, 2);
+            point3 low = c - vec3(0, s, 0), high = c + vec3(0, s, 0);
+            objects.add(make_shared<triangle>(c - vec3(s, 0, 0), low, high, nullptr));
+            objects.add(make_shared<triangle>(low, high, c + vec3(0, 0, s), nullptr));
+            edges.push_back(c);
+        }
+
+        std::vector<ray> rays;
+        rays.reserve(ray_count);
+        for (int k = 0; k < ray_count; ++k) {
+            if (k % 2 == 0) {
+                point3 c = edges[random_int(0, fold_count - 1)];
+                rays.push_back(ray(c - vec3(random_double(0.001, 0.005), 0, 0), vec3(1, 0, random_double(0.01, 1))));
+            } else {
+                auto from = std::static_pointer_cast<triangle>(objects.objects[random_int(0, 2 * fold_count - 1)]);
+                auto u = random_double(), v = random_double() * (1 - u);
+                point3 p = from->point_a + u * (from->point_b - from->point_a) + v * (from->point_c - from->point_a);
+                rays.push_back(ray(p, random_unit_vector()));
+            }
+        }
+
+        options.max_leaf_size = 1;
+        options.layout = bvh_layout::flat;
+        flat_bvh flat(objects, options);
+        options.layout = bvh_layout::wide4;
+        wide4_bvh wide4(objects, options);
+        options.layout = bvh_layout::wide8;
+        wide8_bvh wide8(objects, options);
+        const hittable* wide[2] = {&wide4, &wide8};
+
+        for (int w = 0; w < 2; ++w) {
+            size_t differ = 0;
+            for (const auto& r : rays) {
+                hit_data expected, data;
+                bool expected_hit = flat.hit(r, min_hit_distance(r), infinity, expected);
+                bool wide_hit = wide[w]->hit(r, min_hit_distance(r), infinity, data);
+                if (expected_hit != wide_hit || (expected_hit && expected.t != data.t)
+                    || expected_hit != wide[w]->occluded(r, min_hit_distance(r), infinity))
+                    ++differ;
+            }
+            std::cerr << names[w] << " vs flat, rays from around " << center << ": "
+                      << differ << " of " << rays.size() << " differ\n";
+            agree = agree && differ == 0;
+        }
+    }
+    return agree;
+}
+
+// Image difference
+
+// Compares the rendered image with a reference PFM, typically one rendered at
+// the other precision, and prints how far apart they are: the root mean
+// square and largest difference of the linear values, and the share of 8-bit
+// output values that differ.
+bool compare_to_reference(const framebuffer& fb, const std::string& path) {
+    int width, height;
+    std::vector<float> reference;
+    if (!read_pfm(path, width, height, reference))
+        return false;
+    if (width != fb.width || height != fb.height) {
+        std::cerr << "Reference is " << width << "x" << height
+                  << " but the image is " << fb.width << "x" << fb.height << ".\n";
+        return false;
+    }
+
+    auto rgb = resolve_pixels(fb);
+    std::vector<unsigned char> ours(rgb.size()), theirs(rgb.size());
+    encode_8bit(rgb.data(), ours.data(), rgb.size());
+    encode_8bit(reference.data(), theirs.data(), reference.size());
+
+    double sum_sq = 0, largest = 0;
+    size_t changed = 0;
+    for (size_t k = 0; k < rgb.size(); ++k) {
+        double d = std::fabs(double(rgb[k]) - reference[k]);
+        sum_sq += d * d;
+        largest = std::max(largest, d);
+        if (ours[k] != theirs[k])
+            ++changed;
+    }
+    std::cerr << "\nDifference to " << path << ": RMSE " << std::sqrt(sum_sq / std::max<size_t>(rgb.size(), 1))
+              << ", max " << largest << ", " << 100.0 * changed / std::max<size_t>(rgb.size(), 1)
+              << "% of 8-bit values differ\n";
+    return true;
+}
+
+// Self tests
+
+// A progressive render with a checkpoint interval but nowhere to write
+// checkpoints to must still finish, and with every sample. Exits if it
+// hasn't after ten seconds, since the render can't be stopped.
+bool test_progressive_without_checkpoint_file() {
+    framebuffer fb(8, 8);
+    progressive_settings settings;
+    settings.threads = 2;
+    settings.tile_size = 4;
+    settings.samples_per_pixel = 16;
+    settings.pass_samples = 1;
+    settings.checkpoint_interval = 1e-9;
+    settings.scene_id = 0;
+    settings.adaptive_threshold = 0;
+    settings.min_samples = 0;
+    settings.max_samples = 16;
+
+    auto render = std::async(std::launch::async, [&]() {
+        return render_progressive(fb, settings, [](int, int, uint32_t) { return color(1, 1, 1); });
+    });
+    if (render.wait_for(std::chrono::seconds(10)) == std::future_status::timeout) {
+        std::cerr << "\nProgressive render without a checkpoint file didn't finish.\n";
+        std::_Exit(1);
+    }
+    return render.get() && fb.min_samples() == 16;
+}
+
+// A single triangle lies 10 units along a ray. With every triangle test,
+// occluded() and hit() must find it within 20 units and not within 5,
+// whatever a fresh hit_data holds.
+bool test_triangle_beyond_t_max() {
+    triangle tri(point3(-1, -1, 10), point3(1, -1, 10), point3(0, 1, 10), nullptr);
+    ray r(point3(0, 0, 0), vec3(0, 0, 1));
+    const triangle_test methods[] = {triangle_test::watertight, triangle_test::packet, triangle_test::barycentric};
+
+    auto saved = triangle_method;
+    bool ok = true;
+    for (auto method : methods) {
+        triangle_method = method;
+        hit_data near, far;
+        ok = ok && !tri.occluded(r, min_hit_distance(r), 5) && tri.occluded(r, min_hit_distance(r), 20)
+                && !tri.hit(r, min_hit_distance(r), 5, near) && tri.hit(r, min_hit_distance(r), 20, far);
+    }
+    triangle_method = saved;
+    return ok;
+}
+
+// Runs the tests above, prints the result of each and returns true if all
+// of them passed.
+bool run_self_tests() {
+    struct self_test {
+        const char* name;
+        bool (*run)();
+    };
+    const self_test tests[] = {
+        {"progressive render without a checkpoint file", test_progressive_without_checkpoint_file},
+        {"triangle beyond t_max", test_triangle_beyond_t_max},
+    };
+
+    bool passed = true;
+    for (const auto& test : tests) {
+        bool ok = test.run();
+        std::cerr << "\n" << test.name << ": " << (ok ? "ok" : "FAILED") << "\n";
+        passed = passed && ok;
+    }
+    return passed;
+}
+
+#endif
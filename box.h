@@ -12,7 +12,11 @@ class box : public hittable  {
         box() {}
         box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_data& rec) const override;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            return sides.occluded(r, t_min, t_max);
+        }
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
@@ -40,7 +44,7 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
     sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 }
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
+bool box::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
     return sides.hit(r, t_min, t_max, rec);
 }
 
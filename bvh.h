@@ -5,96 +5,412 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "parallel.h"
 #include <algorithm>
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <string>
 
 
+// Relative costs used by the surface area heuristic (SAH): the cost of visiting
+// a node compared to the cost of intersecting one primitive.
+const double sah_traversal_cost = 0.125;
+const double sah_intersection_cost = 1.0;
+
+enum class bvh_split {
+    median,     // sort along an axis picked per node and split at the median
+    sah         // binned surface area heuristic
+};
+
+bool parse_bvh_split(const std::string& name, bvh_split& split) {
+    if (name == "median")   split = bvh_split::median;
+    else if (name == "sah") split = bvh_split::sah;
+    else return false;
+    return true;
+}
+
+enum class bvh_layout {
+    tree,       // bvh_node objects linked by pointers
+    flat,       // one contiguous array of nodes, see linear_bvh.h
+    wide4,      // four children per node, see wide_bvh.h
+    wide8       // eight children per node
+};
+
+bool parse_bvh_layout(const std::string& name, bvh_layout& layout) {
+    if (name == "tree")       layout = bvh_layout::tree;
+    else if (name == "flat")  layout = bvh_layout::flat;
+    else if (name == "wide4") layout = bvh_layout::wide4;
+    else if (name == "wide8") layout = bvh_layout::wide8;
+    else return false;
+    return true;
+}
+
+struct bvh_build_options {
+    bvh_layout layout = bvh_layout::wide4;
+    bvh_split split = bvh_split::sah;
+    int max_leaf_size = 4;      // most primitives in one SAH leaf
+    int bins = 16;              // SAH candidate splits per axis
+    int threads = 0;            // build threads, 0 means all cores
+};
+
+// Traversal statistics of bvh_node, counted only when built with
+// -DRT_TRAVERSAL_STATS since the shared counters slow tracing down: rays that
+// entered a tree, nodes visited, and children that the ray enters but that
+// were skipped because they lie beyond the closest hit found so far. Without
+// ordered traversal each skipped child would have cost at least one visit.
+#ifdef RT_TRAVERSAL_STATS
+struct bvh_traversal_stats {
+    std::atomic<uint64_t> rays{0};
+    std::atomic<uint64_t> visits{0};
+    std::atomic<uint64_t> skipped{0};
+};
+
+bvh_traversal_stats bvh_stats;
+
+#define BVH_STAT(counter) bvh_stats.counter.fetch_add(1, std::memory_order_relaxed)
+#else
+#define BVH_STAT(counter) ((void)0)
+#endif
+
+// Prints the statistics counted since the last call under label and resets
+// them; with print false they are only reset. Does nothing unless built with
+// -DRT_TRAVERSAL_STATS.
+void report_traversal_stats(const char* label, bool print = true) {
+#ifdef RT_TRAVERSAL_STATS
+    uint64_t rays = bvh_stats.rays.exchange(0);
+    uint64_t visits = bvh_stats.visits.exchange(0);
+    uint64_t skipped = bvh_stats.skipped.exchange(0);
+    if (!print || rays == 0)
+        return;
+    std::cerr << label << ": " << double(visits) / rays << " bvh_node visits per ray, "
+              << double(skipped) / rays << " children skipped per ray\n";
+#else
+    (void)label;
+    (void)print;
+#endif
+}
+
+// Ranges smaller than this are built by the thread that reached them.
+const size_t min_parallel_build_size = 4096;
+
+// How many levels of the tree hand their second child to a new thread. A few
+// more subtrees than threads keeps the workers busy when the splits are
+// uneven.
+int parallel_build_levels(int threads) {
+    int workers = worker_count(threads);
+    if (workers <= 1)
+        return 0;
+    int levels = 2;
+    while ((1 << levels) < 4 * workers)
+        ++levels;
+    return levels;
+}
+
+// Axis of a median split of the primitives [start, end). It varies from node
+// to node like the random axis of the original builder, but only depends on
+// the range, so the tree is the same whichever thread builds the node and
+// can be cached.
+inline int median_split_axis(size_t start, size_t end) {
+    return static_cast<int>(sample_rng::mix(start * 0x9e3779b97f4a7c15ULL ^ end) % 3);
+}
+
+// Primitive reference used while building. The bounds and centroid are
+// computed once up front instead of on every comparison; index refers back
+// to the primitive in the caller's array.
+struct bvh_primitive {
+    aabb box;
+    point3 centroid;
+    uint32_t index;
+};
+
+std::vector<bvh_primitive> make_bvh_primitives(
+    const std::vector<shared_ptr<hittable>>& objects, double time0, double time1, int threads = 0
+) {
+    std::vector<bvh_primitive> prims(objects.size());
+    std::atomic<bool> missing_box(false);
+    parallel_for(objects.size(), threads, min_parallel_build_size, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            if (!objects[k]->bounding_box(time0, time1, prims[k].box))
+                missing_box = true;
+            prims[k].centroid = prims[k].box.centroid();
+            prims[k].index = static_cast<uint32_t>(k);
+        }
+    });
+    if (missing_box)
+        std::cerr << "No bounding box in bvh_node constructor.\n";
+    return prims;
+}
+
+aabb primitive_bounds(const std::vector<bvh_primitive>& prims, size_t start, size_t end) {
+    aabb box = aabb::empty();
+    for (size_t k = start; k < end; ++k)
+        box = surrounding_box(box, prims[k].box);
+    return box;
+}
+
+// Finds the cheapest binned SAH split of prims[start, end), whose bounds are
+// box, and partitions the range around it. Primitives are binned by their
+// centroid along each axis and the split candidates are the boundaries
+// between bins. Returns the index of the first primitive of the right half
+// and sets axis to the split axis, or returns start if the range is cheaper
+// as a leaf.
+size_t sah_partition(
+    std::vector<bvh_primitive>& prims, size_t start, size_t end, const aabb& box,
+    const bvh_build_options& options, int& axis
+) {
+    size_t count = end - start;
+    double area = box.surface_area();
+    double leaf_cost = sah_intersection_cost * count;
+
+    aabb centroid_box = aabb::empty();
+    for (size_t k = start; k < end; ++k)
+        centroid_box = surrounding_box(centroid_box, aabb(prims[k].centroid, prims[k].centroid));
+
+    struct bin {
+        aabb box = aabb::empty();
+        size_t count = 0;
+    };
+
+    int bin_count = std::max(2, options.bins);
+    int best_axis = -1;
+    int best_bin = 0;
+    double best_cost = infinity;
+
+    for (int a = 0; a < 3 && count > 1 && area > 0; ++a) {
+        auto lo = centroid_box.min()[a];
+        auto extent = centroid_box.max()[a] - lo;
+        if (extent <= 0)
+            continue;
+
+        std::vector<bin> bins(bin_count);
+        for (size_t k = start; k < end; ++k) {
+            int b = std::min(bin_count - 1, static_cast<int>(bin_count * (prims[k].centroid[a] - lo) / extent));
+            bins[b].box = surrounding_box(bins[b].box, prims[k].box);
+            bins[b].count++;
+        }
+
+        // right_area[b] and right_count[b] describe bins b+1 .. bin_count-1.
+        std::vector<double> right_area(bin_count - 1);
+        std::vector<size_t> right_count(bin_count - 1);
+        aabb right_box = aabb::empty();
+        size_t right_n = 0;
+        for (int b = bin_count - 1; b > 0; --b) {
+            right_box = surrounding_box(right_box, bins[b].box);
+            right_n += bins[b].count;
+            right_area[b - 1] = right_box.surface_area();
+            right_count[b - 1] = right_n;
+        }
+
+        aabb left_box = aabb::empty();
+        size_t left_n = 0;
+        for (int b = 0; b < bin_count - 1; ++b) {
+            left_box = surrounding_box(left_box, bins[b].box);
+            left_n += bins[b].count;
+            if (left_n == 0 || right_count[b] == 0)
+                continue;
+
+            double split_cost = sah_traversal_cost + sah_intersection_cost
+                * (left_n * left_box.surface_area() + right_count[b] * right_area[b]) / area;
+            if (split_cost < best_cost) {
+                best_cost = split_cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (count <= static_cast<size_t>(options.max_leaf_size) && (best_axis < 0 || leaf_cost <= best_cost))
+        return start;
+
+    // Primitives that can't be separated by their centroids are split evenly
+    // along the longest axis.
+    if (best_axis < 0) {
+        auto extent = box.max() - box.min();
+        axis = (extent.x() > extent.y() && extent.x() > extent.z()) ? 0 : (extent.y() > extent.z() ? 1 : 2);
+        return start + count/2;
+    }
+
+    auto lo = centroid_box.min()[best_axis];
+    auto extent = centroid_box.max()[best_axis] - lo;
+    auto split = std::partition(prims.begin() + start, prims.begin() + end, [&](const bvh_primitive& p) {
+        int b = std::min(bin_count - 1, static_cast<int>(bin_count * (p.centroid[best_axis] - lo) / extent));
+        return b <= best_bin;
+    });
+
+    axis = best_axis;
+    size_t mid = split - prims.begin();
+    return (mid == start || mid == end) ? start + count/2 : mid;
+}
+
 class bvh_node : public hittable {
     public:
-        bvh_node();
+        bvh_node() {}
 
         bvh_node(const hittable_list& list, double time0, double time1)
             : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
         {}
 
+        // Median split builder.
         bvh_node(
             const std::vector<shared_ptr<hittable>>& src_objects,
             size_t start, size_t end, double time0, double time1);
 
+        // Builds the tree over objects with the split method of options,
+        // reordering prims[start, end) in place. Large subtrees are built in
+        // parallel.
+        bvh_node(
+            const std::vector<shared_ptr<hittable>>& objects,
+            std::vector<bvh_primitive>& prims, size_t start, size_t end,
+            const bvh_build_options& options);
+
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& rec) const override;
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            if (!leaf.empty())
+                return transformed_box_of(leaf, t, output_box);
+            std::vector<shared_ptr<hittable>> children = {left, right};
+            return transformed_box_of(children, t, output_box);
+        }
+
+        virtual int transform_depth() const override {
+            if (!leaf.empty())
+                return transform_depth_of(leaf);
+            return std::max(left->transform_depth(), right->transform_depth());
+        }
+
+        // Expected cost of tracing a ray through this tree under the SAH, in
+        // units of primitive intersections.
+        double sah_cost() const {
+            return cost / box.surface_area();
+        }
+
     public:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
+        std::vector<shared_ptr<hittable>> leaf;     // primitives of an SAH leaf
         aabb box;
-};
-
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
-
-    if (!a->bounding_box(0,0, box_a) || !b->bounding_box(0,0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+        aabb left_box;
+        aabb right_box;
+        bool primitive_children = false;    // left and right are primitives, not bvh_nodes
+        double cost;    // SAH cost of the subtree times the surface area of box
+
+    private:
+        // hit() once the ray is known to enter box.
+        bool traverse(const ray& r, real t_min, real t_max, hit_data& rec) const;
+
+        bool visit(const hittable& child, const ray& r, real t_min, real t_max, hit_data& rec) const {
+            if (primitive_children)
+                return child.hit(r, t_min, t_max, rec);
+            return static_cast<const bvh_node&>(child).traverse(r, t_min, t_max, rec);
+        }
 
-    return box_a.min().e[axis] < box_b.min().e[axis];
-}
+        // occluded() once the ray is known to enter box.
+        bool traverse_occluded(const ray& r, real t_min, real t_max) const;
 
+        bool visit_occluded(const hittable& child, const ray& r, real t_min, real t_max) const {
+            if (primitive_children)
+                return child.occluded(r, t_min, t_max);
+            return static_cast<const bvh_node&>(child).traverse_occluded(r, t_min, t_max);
+        }
 
-bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
-}
+        void build(
+            const std::vector<shared_ptr<hittable>>& objects,
+            std::vector<bvh_primitive>& prims, size_t start, size_t end,
+            const bvh_build_options& options, int spawn_levels);
+};
 
-bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+bvh_node::bvh_node(
+    const std::vector<shared_ptr<hittable>>& src_objects,
+    size_t start, size_t end, double time0, double time1
+) {
+    // Only the primitive references are reordered; src_objects is left alone.
+    bvh_build_options options;
+    options.split = bvh_split::median;
+    auto prims = make_bvh_primitives(src_objects, time0, time1);
+    build(src_objects, prims, start, end, options, 0);
 }
 
-bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+bvh_node::bvh_node(
+    const std::vector<shared_ptr<hittable>>& objects,
+    std::vector<bvh_primitive>& prims, size_t start, size_t end,
+    const bvh_build_options& options
+) {
+    build(objects, prims, start, end, options, parallel_build_levels(options.threads));
 }
 
-bvh_node::bvh_node(
-    const std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
+void bvh_node::build(
+    const std::vector<shared_ptr<hittable>>& objects,
+    std::vector<bvh_primitive>& prims, size_t start, size_t end,
+    const bvh_build_options& options, int spawn_levels
 ) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
-
-    int axis = random_int(0,2);
-    auto comparator = (axis == 0) ? box_x_compare
-                    : (axis == 1) ? box_y_compare
-                                  : box_z_compare;
-
-    size_t object_span = end - start;
-
-    if (object_span == 1) {
-        left = right = objects[start];
-    } else if (object_span == 2) {
-        if (comparator(objects[start], objects[start+1])) {
-            left = objects[start];
-            right = objects[start+1];
-        } else {
-            left = objects[start+1];
-            right = objects[start];
+    size_t count = end - start;
+    size_t mid;
+
+    if (options.split == bvh_split::median) {
+        int axis = median_split_axis(start, end);
+        auto compare = [axis](const bvh_primitive& a, const bvh_primitive& b) {
+            return a.box.min()[axis] < b.box.min()[axis];
+        };
+
+        if (count <= 2) {
+            if (count == 2 && !compare(prims[start], prims[start+1]))
+                std::swap(prims[start], prims[start+1]);
+            const auto& first = prims[start];
+            const auto& last = prims[end-1];
+            left = objects[first.index];
+            right = objects[last.index];
+            left_box = first.box;
+            right_box = last.box;
+            primitive_children = true;
+            box = surrounding_box(first.box, last.box);
+            cost = sah_traversal_cost * box.surface_area()
+                 + sah_intersection_cost * (first.box.surface_area() + last.box.surface_area());
+            return;
         }
-    } else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-        auto mid = start + object_span/2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
-    }
 
-    aabb box_left, box_right;
+        std::sort(prims.begin() + start, prims.begin() + end, compare);
+        mid = start + count/2;
+    } else {
+        box = primitive_bounds(prims, start, end);
 
-    if (  !left->bounding_box(time0, time1, box_left)
-       || !right->bounding_box(time0, time1, box_right)
-    )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+        int axis = 0;
+        mid = sah_partition(prims, start, end, box, options, axis);
 
-    box = surrounding_box(box_left, box_right);
+        if (mid == start) {
+            for (size_t k = start; k < end; ++k)
+                leaf.push_back(objects[prims[k].index]);
+            cost = sah_intersection_cost * leaf.size() * box.surface_area();
+            return;
+        }
+    }
 
+    // The two halves are disjoint ranges of prims, so they can be built
+    // concurrently.
+    auto left_node = make_shared<bvh_node>();
+    auto right_node = make_shared<bvh_node>();
+    if (spawn_levels > 0 && count >= min_parallel_build_size) {
+        auto right_task = std::async(std::launch::async, [&]() {
+            right_node->build(objects, prims, mid, end, options, spawn_levels - 1);
+        });
+        left_node->build(objects, prims, start, mid, options, spawn_levels - 1);
+        right_task.get();
+    } else {
+        left_node->build(objects, prims, start, mid, options, 0);
+        right_node->build(objects, prims, mid, end, options, 0);
+    }
 
+    left = left_node;
+    right = right_node;
+    left_box = left_node->box;
+    right_box = right_node->box;
+    box = surrounding_box(left_box, right_box);
+    cost = sah_traversal_cost * box.surface_area() + left_node->cost + right_node->cost;
 }
 
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
@@ -102,15 +418,75 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
     return true;
 }
 
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
+bool bvh_node::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    BVH_STAT(rays);
     if (!box.hit(r, t_min, t_max))
-
         return false;
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    return traverse(r, t_min, t_max, rec);
+}
+
+// Both children's boxes are tested here, and the child the ray enters first
+// is visited first, so that its hit can cut the other child off. A child the
+// ray only enters beyond the closest hit so far is skipped.
+bool bvh_node::traverse(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    BVH_STAT(visits);
+    if (!leaf.empty()) {
+        bool hit_anything = false;
+        for (const auto& object : leaf) {
+            if (object->hit(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    real t_left, t_right;
+    bool enter_left = left_box.hit(r, t_min, t_max, t_left);
+    bool enter_right = right_box.hit(r, t_min, t_max, t_right);
+
+    const hittable* near = left.get();
+    const hittable* far = right.get();
+    bool enter_near = enter_left, enter_far = enter_right;
+    real t_far = t_right;
+    if (enter_right && (!enter_left || t_right < t_left)) {
+        std::swap(near, far);
+        std::swap(enter_near, enter_far);
+        t_far = t_left;
+    }
+
+    bool hit_anything = false;
+    if (enter_near && visit(*near, r, t_min, t_max, rec)) {
+        hit_anything = true;
+        t_max = rec.t;
+    }
+    if (enter_far) {
+        if (t_far > t_max)
+            BVH_STAT(skipped);
+        else if (visit(*far, r, t_min, t_max, rec))
+            hit_anything = true;
+    }
+    return hit_anything;
+}
+
+bool bvh_node::occluded(const ray& r, real t_min, real t_max) const {
+    BVH_STAT(rays);
+    return box.hit(r, t_min, t_max) && traverse_occluded(r, t_min, t_max);
+}
 
+// Any hit ends the query, so the children are visited in their stored order.
+bool bvh_node::traverse_occluded(const ray& r, real t_min, real t_max) const {
+    BVH_STAT(visits);
+    if (!leaf.empty()) {
+        for (const auto& object : leaf)
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
 
-    return hit_left || hit_right;
+    if (left_box.hit(r, t_min, t_max) && visit_occluded(*left, r, t_min, t_max))
+        return true;
+    return right_box.hit(r, t_min, t_max) && visit_occluded(*right, r, t_min, t_max);
 }
 
 #endif
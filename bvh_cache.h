@@ -0,0 +1,157 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "mesh_cache.h"
+#include "obj_loader.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+// BVH cache files
+
+// The nodes and primitive order of a mesh BVH as built, before the mesh
+// puts its triangles in leaf order. Layout (native endianness):
+//   bvh_file_header
+//   node     nodes[node_count]         linear_bvh_node or wide_bvh_node
+//   uint32_t indices[index_count]
+struct bvh_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint64_t key;               // see bvh_cache_key()
+    uint64_t node_count;
+    uint64_t index_count;
+    uint64_t checksum;          // of everything after the header
+};
+
+const char bvh_file_magic[8] = {'R','T','B','V','H','\0','\0','\0'};
+const uint32_t bvh_file_version = 1;
+
+// BVHs of meshes loaded from a file are cached next to it, with this
+// appended to the name of the OBJ file.
+const std::string bvh_file_extension = ".rtbvh";
+
+// Where the BVH of the mesh at mesh_path is cached.
+std::string bvh_cache_path(const std::string& mesh_path) {
+    std::string base = mesh_path;
+    if (base.size() > mesh_file_extension.size()
+        && base.compare(base.size() - mesh_file_extension.size(), std::string::npos, mesh_file_extension) == 0)
+        base.resize(base.size() - mesh_file_extension.size());
+    return base + bvh_file_extension;
+}
+
+// Identifies a BVH by the triangles it is built over and every setting that
+// changes the tree. The thread count only changes how fast it is built: both
+// builders split the same ranges on any number of threads, and the median
+// split takes its axis from the range, see median_split_axis().
+uint64_t bvh_cache_key(const mesh_data& geometry, const bvh_build_options& options, size_t node_size) {
+    uint64_t key = mesh_file_checksum(reinterpret_cast<const char*>(geometry.positions.data()),
+                                      sizeof(float) * geometry.positions.size());
+    key = sample_rng::mix(key ^ mesh_file_checksum(reinterpret_cast<const char*>(geometry.indices.data()),
+                                                   sizeof(uint32_t) * geometry.indices.size()));
+    uint64_t settings[] = {node_size, sizeof(real), uint64_t(options.split), uint64_t(options.max_leaf_size),
+                           uint64_t(options.bins)};
+    for (auto setting : settings)
+        key = sample_rng::mix(key ^ setting);
+    return key;
+}
+
+// Writes the nodes and primitive order of tree to path atomically.
+template <typename tree_type>
+bool save_bvh_cache(const tree_type& tree, uint64_t key, const std::string& path) {
+    typedef typename std::decay<decltype(tree.nodes[0])>::type node_type;
+    size_t node_bytes = sizeof(node_type) * tree.nodes.size();
+    size_t index_bytes = sizeof(uint32_t) * tree.indices.size();
+
+    std::string body(node_bytes + index_bytes, '\0');
+    std::memcpy(&body[0], tree.nodes.data(), node_bytes);
+    std::memcpy(&body[node_bytes], tree.indices.data(), index_bytes);
+
+    bvh_file_header header;
+    std::memcpy(header.magic, bvh_file_magic, sizeof(header.magic));
+    header.version = bvh_file_version;
+    header.node_size = sizeof(node_type);
+    header.key = key;
+    header.node_count = tree.nodes.size();
+    header.index_count = tree.indices.size();
+    header.checksum = mesh_file_checksum(body.data(), body.size());
+
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE* file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Could not open " << tmp_path << " for writing.\n";
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+           && std::fwrite(body.data(), 1, body.size(), file) == body.size();
+    ok = (std::fclose(file) == 0) && ok;
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write " << path << ".\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Maps the cache file at path and, if it holds a tree with this key over
+// primitive_count primitives that passes its checksum and structure checks,
+// copies it into tree. Returns false if the tree has to be built instead.
+template <typename tree_type>
+bool load_bvh_cache(tree_type& tree, uint64_t key, size_t primitive_count, const std::string& path) {
+    typedef typename std::decay<decltype(tree.nodes[0])>::type node_type;
+    if (access(path.c_str(), F_OK) != 0)
+        return false;
+    file_view file;
+    if (!file.open(path))
+        return false;
+
+    bvh_file_header header;
+    if (file.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, bvh_file_magic, sizeof(header.magic)) != 0 || header.version != bvh_file_version
+        || header.node_size != sizeof(node_type) || header.key != key || header.index_count != primitive_count)
+        return false;
+
+    size_t node_bytes = sizeof(node_type) * header.node_count;
+    size_t index_bytes = sizeof(uint32_t) * header.index_count;
+    const char* body = file.data() + sizeof(header);
+    if (file.size() != sizeof(header) + node_bytes + index_bytes
+        || mesh_file_checksum(body, node_bytes + index_bytes) != header.checksum) {
+        std::cerr << path << " is damaged, rebuilding the BVH.\n";
+        return false;
+    }
+
+    tree.nodes.resize(header.node_count);
+    tree.indices.resize(header.index_count);
+    std::memcpy(tree.nodes.data(), body, node_bytes);
+    std::memcpy(tree.indices.data(), body + node_bytes, index_bytes);
+
+    // The primitive order has to be a permutation for the mesh to reorder
+    // its triangles by it.
+    std::vector<bool> seen(primitive_count, false);
+    bool ok = tree.well_formed(primitive_count);
+    for (size_t k = 0; ok && k < tree.indices.size(); ++k) {
+        ok = tree.indices[k] < primitive_count && !seen[tree.indices[k]];
+        if (ok)
+            seen[tree.indices[k]] = true;
+    }
+    if (!ok) {
+        std::cerr << path << " holds an invalid BVH, rebuilding it.\n";
+        tree = tree_type();
+        return false;
+    }
+    return true;
+}
+
+#endif
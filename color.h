@@ -5,6 +5,11 @@
 
 #include <iostream>
 
+// Relative luminance (Rec. 709 primaries) of a linear color.
+inline double luminance(const color& c) {
+    return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+}
+
 void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
@@ -0,0 +1,98 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "utility.h"
+#include "color.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// Floating-point accumulation buffer. Every pixel keeps the sum of its samples
+// and how many samples went into that sum, so a render can be stopped and
+// continued at any point without losing work. The sum of squared sample
+// luminances is kept as well, which gives the variance of every pixel's
+// estimate for adaptive sampling.
+// Row 0 is the top scanline, matching the order the image is written in.
+class framebuffer {
+    public:
+        framebuffer(int w, int h)
+            : width(w), height(h), pixels(w * h), luminance_sq(w * h, 0.0),
+              samples(w * h, 0), converged(w * h, 0) {}
+
+        color& at(int i, int j) { return pixels[j * width + i]; }
+        const color& at(int i, int j) const { return pixels[j * width + i]; }
+
+        uint32_t& sample_count(int i, int j) { return samples[j * width + i]; }
+        uint32_t sample_count(int i, int j) const { return samples[j * width + i]; }
+
+        void add_sample(int i, int j, const color& sample) {
+            auto p = j * width + i;
+            auto l = luminance(sample);
+            pixels[p] += sample;
+            luminance_sq[p] += l*l;
+            ++samples[p];
+        }
+
+        // Standard error of the pixel's mean luminance relative to that mean.
+        // Dark pixels are measured against a floor so that they can converge.
+        double relative_error(size_t p) const {
+            auto n = samples[p];
+            if (n < 2)
+                return infinity;
+            auto mean = luminance(pixels[p]) / n;
+            auto variance = std::max(0.0, (luminance_sq[p] - mean*mean*n) / (n - 1));
+            return sqrt(variance / n) / std::max(mean, 0.01);
+        }
+
+        uint32_t min_samples() const {
+            return samples.empty() ? 0 : *std::min_element(samples.begin(), samples.end());
+        }
+
+        // Fewest samples of any pixel that is still being sampled, or
+        // UINT32_MAX once every pixel has converged.
+        uint32_t min_active_samples() const {
+            uint32_t result = UINT32_MAX;
+            for (size_t p = 0; p < samples.size(); ++p)
+                if (!converged[p])
+                    result = std::min(result, samples[p]);
+            return result;
+        }
+
+        uint64_t total_samples() const {
+            uint64_t total = 0;
+            for (auto n : samples)
+                total += n;
+            return total;
+        }
+
+        // Writes the number of samples of every pixel as a binary PGM image,
+        // scaled so that the most sampled pixel is white.
+        void write_sample_map(std::ostream &out) const {
+            uint32_t most = std::max<uint32_t>(1, *std::max_element(samples.begin(), samples.end()));
+            std::vector<unsigned char> gray(samples.size());
+            for (size_t p = 0; p < samples.size(); ++p)
+                gray[p] = static_cast<unsigned char>(255.0 * samples[p] / most + 0.5);
+
+            out << "P5\n" << width << " " << height << "\n255\n";
+            out.write(reinterpret_cast<const char*>(gray.data()), gray.size());
+        }
+
+        void write(std::ostream &out) const {
+            //This line is important for ppm images
+            out << "P3\n" << width << " " << height << "\n255\n";
+
+            for (size_t p = 0; p < pixels.size(); ++p)
+                write_color(out, pixels[p], std::max<uint32_t>(samples[p], 1));
+        }
+
+    public:
+        int width;
+        int height;
+        std::vector<color> pixels;          // sum of all samples per pixel
+        std::vector<double> luminance_sq;   // sum of squared sample luminances
+        std::vector<uint32_t> samples;      // number of samples per pixel
+        std::vector<unsigned char> converged;   // set once a pixel stops being sampled
+};
+
+#endif
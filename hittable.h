@@ -4,16 +4,51 @@
 #include "ray.h"
 #include "utility.h"
 #include "aabb.h"
+#include "transform.h"
+
+#include <cassert>
+#include <vector>
 
 class material;
+class hittable;
+
+// Most transforms (translate, rotate_y, instance) that may be nested above a
+// primitive. Deeper scenes are refused, see check_transform_depth().
+const int max_transform_depth = 7;
 
+// Result of a ray query. hit() only records where along the ray the closest
+// hit is and what was hit; the surface attributes below are computed once,
+// for the final closest hit, by hit_surface().
 struct hit_data {
+    real t;
+    uint32_t primitive;     // which part of the object, e.g. the triangle of a mesh
+    real u, v;              // barycentric weights of the second and third vertex
+
+    // path[0] is the object that was hit, followed by the transforms above
+    // it, innermost first.
+    const hittable* path[max_transform_depth + 1];
+    int path_size;
+
     point3 hit_point;
     vec3 hit_normal;
-    shared_ptr<material> material_pointer;
-    double t;
+    const material* material_pointer;   // owned by the object that was hit
     bool front_face;
 
+    inline void set_hit(real t_hit, const hittable* object, uint32_t id = 0, real u_hit = 0, real v_hit = 0) {
+        t = t_hit;
+        primitive = id;
+        u = u_hit;
+        v = v_hit;
+        path[0] = object;
+        path_size = 1;
+    }
+
+    // Called by a transform whose child recorded a hit.
+    inline void push_transform(const hittable* transform) {
+        assert(path_size <= max_transform_depth);
+        path[path_size++] = transform;
+    }
+
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         hit_normal = front_face ? outward_normal :-outward_normal;
@@ -22,35 +57,125 @@ struct hit_data {
 
 class hittable {
     public:
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_data& data) const = 0;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_data& data) const = 0;
          virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // Fills in the surface attributes of the hit that hit() recorded in
+        // data, for r in this object's space. Only objects that record
+        // themselves in data.path implement it.
+        virtual void surface(const ray& r, hit_data& data) const {}
+
+        // True if anything blocks r within (t_min, t_max), for visibility
+        // queries such as shadow rays. Any intersection will do, so groups of
+        // objects stop at the first one they find, and neither the surface
+        // nor the material is looked at. By default this is hit(), which
+        // costs no more for a primitive that the ray can only hit once.
+        virtual bool occluded(const ray& r, real t_min, real t_max) const {
+            hit_data data;
+            return hit(r, t_min, t_max, data);
+        }
+
+        // Moves the object's own geometry by t, so that it no longer needs the
+        // transform above it, and returns true. Objects that can't hold the
+        // transformed shape return false and stay as they are. Only for
+        // objects that are not shared, see freeze_transforms().
+        virtual bool apply_transform(const mat34& t) {
+            return false;
+        }
+
+        // Bounding box of the object moved by t. By default the corners of
+        // bounding_box() are transformed, which is loose under rotation;
+        // objects that know their shape give a tight box.
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const {
+            if (!bounding_box(0, 1, output_box))
+                return false;
+            output_box = transform_box(t, output_box);
+            return true;
+        }
+
+        // Most transforms on a path from this object down to a primitive.
+        virtual int transform_depth() const {
+            return 0;
+        }
 };
 
+// Union of the boxes of objects moved by t; false if one of them has none.
+bool transformed_box_of(const std::vector<shared_ptr<hittable>>& objects, const mat34& t, aabb& output_box) {
+    if (objects.empty())
+        return false;
+    output_box = aabb::empty();
+    for (const auto& object : objects) {
+        aabb box;
+        if (!object->transformed_box(t, box))
+            return false;
+        output_box = surrounding_box(output_box, box);
+    }
+    return true;
+}
+
+// Most transforms above a primitive in any of objects.
+int transform_depth_of(const std::vector<shared_ptr<hittable>>& objects) {
+    int depth = 0;
+    for (const auto& object : objects)
+        depth = std::max(depth, object->transform_depth());
+    return depth;
+}
+
+// Closest hit along r within (t_min, t_max) with its surface attributes.
+bool hit_surface(const hittable& world, const ray& r, real t_min, real t_max, hit_data& data) {
+    if (!world.hit(r, t_min, t_max, data))
+        return false;
+    data.path[data.path_size - 1]->surface(r, data);
+    return true;
+}
+
 class translate : public hittable {
     public:
         translate(shared_ptr<hittable> p, const vec3& displacement)
             : ptr(p), offset(displacement) {}
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& rec) const override;
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual void surface(const ray& r, hit_data& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            return ptr->occluded(r.moved_to(r.origin() - offset), t_min, t_max);
+        }
+
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            return ptr->transformed_box(t * mat34::translation(offset), output_box);
+        }
+
+        virtual int transform_depth() const override {
+            return 1 + ptr->transform_depth();
+        }
+
     public:
         shared_ptr<hittable> ptr;
         vec3 offset;
 };
 
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
+bool translate::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    ray moved_r = r.moved_to(r.origin() - offset);
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
+    rec.push_transform(this);
+    return true;
+}
+
+
+void translate::surface(const ray& r, hit_data& rec) const {
+    ray moved_r = r.moved_to(r.origin() - offset);
+    --rec.path_size;
+    rec.path[rec.path_size - 1]->surface(moved_r, rec);
+
     rec.hit_point += offset;
     rec.set_face_normal(moved_r, rec.hit_normal);
-
-    return true;
 }
 
 
@@ -71,17 +196,42 @@ class rotate_y : public hittable {
         rotate_y(shared_ptr<hittable> p, double angle);
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& rec) const override;
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
         }
 
+        virtual void surface(const ray& r, hit_data& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            return ptr->occluded(rotated(r), t_min, t_max);
+        }
+
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            return ptr->transformed_box(t * matrix(), output_box);
+        }
+
+        virtual int transform_depth() const override {
+            return 1 + ptr->transform_depth();
+        }
+
+        // The rotation as a matrix, from the object to the world.
+        mat34 matrix() const {
+            mat34 m = mat34::identity();
+            m.m[0][0] = cos_theta;  m.m[0][2] = sin_theta;
+            m.m[2][0] = -sin_theta; m.m[2][2] = cos_theta;
+            return m;
+        }
+
+    private:
+        ray rotated(const ray& r) const;
+
     public:
         shared_ptr<hittable> ptr;
-        double sin_theta;
-        double cos_theta;
+        real sin_theta;
+        real cos_theta;
         bool hasbox;
         aabb bbox;
 };
@@ -120,7 +270,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_data& rec) const {
+ray rotate_y::rotated(const ray& r) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -130,11 +280,24 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_data& rec) cons
     direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
     direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+}
+
 
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    if (!ptr->hit(rotated(r), t_min, t_max, rec))
         return false;
 
+    rec.push_transform(this);
+    return true;
+}
+
+
+void rotate_y::surface(const ray& r, hit_data& rec) const {
+    ray rotated_r = rotated(r);
+    --rec.path_size;
+    rec.path[rec.path_size - 1]->surface(rotated_r, rec);
+
     auto p = rec.hit_point;
     auto normal = rec.hit_normal;
 
@@ -146,8 +309,6 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_data& rec) cons
 
     rec.hit_point = p;
     rec.set_face_normal(rotated_r, normal);
-
-    return true;
 }
 
 
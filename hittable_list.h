@@ -18,25 +18,40 @@ class hittable_list : public hittable {
         void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& data) const override;
+            const ray& r, real t_min, real t_max, hit_data& data) const override;
 
         virtual bool bounding_box(
             double time0, double time1, aabb& output_box) const override;
 
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            for (const auto& object : objects)
+                if (object->occluded(r, t_min, t_max))
+                    return true;
+            return false;
+        }
+
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            return transformed_box_of(objects, t, output_box);
+        }
+
+        virtual int transform_depth() const override {
+            return transform_depth_of(objects);
+        }
+
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_data& data) const {
-    hit_data temp_data;
+// hit() only writes data when it finds a closer hit, so every object can
+// record straight into data.
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_data& data) const {
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_data)) {
+        if (object->hit(r, t_min, closest_so_far, data)) {
             hit_anything = true;
-            closest_so_far = temp_data.t;
-            data = temp_data;
+            closest_so_far = data.t;
         }
     }
 
@@ -0,0 +1,296 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum class image_format { p3, ppm, pfm, exr };
+
+bool parse_image_format(const std::string& name, image_format& format) {
+    if (name == "p3")       format = image_format::p3;
+    else if (name == "ppm") format = image_format::ppm;
+    else if (name == "pfm") format = image_format::pfm;
+    else if (name == "exr") format = image_format::exr;
+    else return false;
+    return true;
+}
+
+// Picks the format from the file extension; anything unknown is binary PPM.
+image_format format_from_path(const std::string& path) {
+    auto dot = path.rfind('.');
+    image_format format = image_format::ppm;
+    if (dot != std::string::npos)
+        parse_image_format(path.substr(dot + 1), format);
+    return format == image_format::p3 ? image_format::ppm : format;
+}
+
+// Averages the accumulated samples into linear RGB floats, top row first.
+std::vector<float> resolve_pixels(const framebuffer& fb) {
+    std::vector<float> rgb(fb.pixels.size() * 3);
+    for (size_t p = 0; p < fb.pixels.size(); ++p) {
+        auto scale = 1.0 / std::max<uint32_t>(fb.samples[p], 1);
+        for (int c = 0; c < 3; ++c)
+            rgb[p*3 + c] = static_cast<float>(fb.pixels[p][c] * scale);
+    }
+    return rgb;
+}
+
+// Gamma-corrects (gamma=2.0) and clamps linear values to [0,255] bytes in one
+// pass over the buffer, four values at a time where SSE2 is available.
+// Negative and NaN values map to 0.
+void encode_8bit(const float* in, unsigned char* out, size_t n) {
+    size_t k = 0;
+#ifdef __SSE2__
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 top = _mm_set1_ps(0.999f);
+    const __m128 scale = _mm_set1_ps(256.0f);
+    for (; k + 4 <= n; k += 4) {
+        __m128 v = _mm_max_ps(_mm_loadu_ps(in + k), zero);
+        v = _mm_min_ps(_mm_sqrt_ps(v), top);
+        __m128i i = _mm_cvttps_epi32(_mm_mul_ps(v, scale));
+        i = _mm_packs_epi32(i, i);
+        i = _mm_packus_epi16(i, i);
+        int32_t packed = _mm_cvtsi128_si32(i);
+        std::memcpy(out + k, &packed, 4);
+    }
+#endif
+    for (; k < n; ++k) {
+        float v = in[k] > 0.0f ? std::sqrt(in[k]) : 0.0f;
+        out[k] = static_cast<unsigned char>(256.0f * std::min(v, 0.999f));
+    }
+}
+
+// Binary PPM (P6)
+void write_ppm(std::ostream& out, int width, int height, const std::vector<float>& rgb) {
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    std::vector<unsigned char> data(header.size() + rgb.size());
+    std::memcpy(data.data(), header.data(), header.size());
+    encode_8bit(rgb.data(), data.data() + header.size(), rgb.size());
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+inline bool little_endian() {
+    const uint16_t one = 1;
+    return *reinterpret_cast<const unsigned char*>(&one) == 1;
+}
+
+// Portable float map. Rows are stored bottom to top; the negative scale
+// marks the data as little-endian.
+void write_pfm(std::ostream& out, int width, int height, const std::vector<float>& rgb) {
+    std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height)
+                       + (little_endian() ? "\n-1.0\n" : "\n1.0\n");
+    size_t row_bytes = size_t(width) * 3 * sizeof(float);
+    std::vector<char> data(header.size() + row_bytes * height);
+    std::memcpy(data.data(), header.data(), header.size());
+    for (int j = 0; j < height; ++j)
+        std::memcpy(data.data() + header.size() + row_bytes * (height - 1 - j), &rgb[size_t(j) * width * 3], row_bytes);
+    out.write(data.data(), data.size());
+}
+
+// Reads a PFM file written by write_pfm(), or any RGB PFM, into linear RGB
+// floats, top row first.
+bool read_pfm(const std::string& path, int& width, int& height, std::vector<float>& rgb) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    double scale = 0;
+    if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0 || scale == 0) {
+        std::cerr << "Could not read " << path << " as an RGB PFM image.\n";
+        return false;
+    }
+    in.get();
+
+    size_t row_values = size_t(width) * 3;
+    rgb.resize(row_values * height);
+    for (int j = height - 1; j >= 0; --j)
+        in.read(reinterpret_cast<char*>(&rgb[size_t(j) * row_values]), row_values * sizeof(float));
+    if (!in) {
+        std::cerr << path << " is truncated.\n";
+        return false;
+    }
+
+    if ((scale < 0) != little_endian()) {
+        for (auto& value : rgb) {
+            auto bytes = reinterpret_cast<unsigned char*>(&value);
+            std::reverse(bytes, bytes + sizeof(float));
+        }
+    }
+    return true;
+}
+
+// OpenEXR
+
+// Little-endian byte writer for building the file in memory.
+class byte_writer {
+    public:
+        void bytes(const void* p, size_t n) {
+            auto c = static_cast<const unsigned char*>(p);
+            data.insert(data.end(), c, c + n);
+        }
+        void string(const char* s) { bytes(s, std::strlen(s) + 1); }
+        void u8(uint8_t v) { data.push_back(v); }
+        void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+        void u32(uint32_t v) { for (int b = 0; b < 4; ++b) data.push_back((v >> (8*b)) & 0xff); }
+        void u64(uint64_t v) { for (int b = 0; b < 8; ++b) data.push_back((v >> (8*b)) & 0xff); }
+        void f32(float v) { uint32_t u; std::memcpy(&u, &v, 4); u32(u); }
+
+        void attribute(const char* name, const char* type, uint32_t size) {
+            string(name);
+            string(type);
+            u32(size);
+        }
+
+    public:
+        std::vector<unsigned char> data;
+};
+
+// OpenEXR RLE compression of one chunk: bytes are split into even and odd
+// halves, delta encoded, then run-length encoded. Returns false if the result
+// would not be smaller, in which case the chunk is stored uncompressed.
+bool exr_rle_compress(const std::vector<unsigned char>& raw, std::vector<unsigned char>& packed) {
+    const int min_run = 3;
+    const int max_run = 127;
+    size_t n = raw.size();
+
+    std::vector<unsigned char> tmp(n);
+    size_t half = (n + 1) / 2;
+    for (size_t k = 0; k < n; ++k)
+        tmp[(k % 2 == 0) ? k / 2 : half + k / 2] = raw[k];
+
+    int prev = tmp.empty() ? 0 : tmp[0];
+    for (size_t k = 1; k < n; ++k) {
+        int d = int(tmp[k]) - prev + (128 + 256);
+        prev = tmp[k];
+        tmp[k] = static_cast<unsigned char>(d);
+    }
+
+    packed.clear();
+    size_t run_start = 0;
+    size_t run_end = 1;
+    while (run_start < n) {
+        while (run_end < n && tmp[run_start] == tmp[run_end] && run_end - run_start - 1 < size_t(max_run))
+            ++run_end;
+
+        if (run_end - run_start >= size_t(min_run)) {
+            packed.push_back(static_cast<unsigned char>(run_end - run_start - 1));
+            packed.push_back(tmp[run_start]);
+            run_start = run_end;
+        } else {
+            while (run_end < n
+                   && ((run_end + 1 >= n || tmp[run_end] != tmp[run_end + 1])
+                       || (run_end + 2 >= n || tmp[run_end + 1] != tmp[run_end + 2]))
+                   && run_end - run_start < size_t(max_run))
+                ++run_end;
+
+            packed.push_back(static_cast<unsigned char>(-static_cast<int>(run_end - run_start)));
+            packed.insert(packed.end(), tmp.begin() + run_start, tmp.begin() + run_end);
+            run_start = run_end;
+        }
+        ++run_end;
+
+        if (packed.size() >= n)
+            return false;
+    }
+    return true;
+}
+
+// Single-part scanline OpenEXR with 32-bit float R, G, B channels and
+// lossless RLE compression, one scanline per chunk.
+void write_exr(std::ostream& out, int width, int height, const std::vector<float>& rgb) {
+    byte_writer w;
+    const unsigned char magic[4] = {0x76, 0x2f, 0x31, 0x01};
+    w.bytes(magic, 4);
+    w.u32(2);   // version 2, single-part scanline file
+
+    // Channels are stored in alphabetical order.
+    const char* channel_names[3] = {"B", "G", "R"};
+    const int channel_index[3] = {2, 1, 0};
+    const int float_pixel_type = 2;
+
+    w.attribute("channels", "chlist", 3 * 18 + 1);
+    for (auto name : channel_names) {
+        w.string(name);
+        w.i32(float_pixel_type);
+        w.u8(0);                // pLinear
+        w.u8(0); w.u8(0); w.u8(0);
+        w.i32(1);               // xSampling
+        w.i32(1);               // ySampling
+    }
+    w.u8(0);
+
+    w.attribute("compression", "compression", 1);
+    w.u8(1);    // RLE_COMPRESSION
+
+    w.attribute("dataWindow", "box2i", 16);
+    w.i32(0); w.i32(0); w.i32(width - 1); w.i32(height - 1);
+
+    w.attribute("displayWindow", "box2i", 16);
+    w.i32(0); w.i32(0); w.i32(width - 1); w.i32(height - 1);
+
+    w.attribute("lineOrder", "lineOrder", 1);
+    w.u8(0);    // INCREASING_Y
+
+    w.attribute("pixelAspectRatio", "float", 4);
+    w.f32(1.0f);
+
+    w.attribute("screenWindowCenter", "v2f", 8);
+    w.f32(0.0f); w.f32(0.0f);
+
+    w.attribute("screenWindowWidth", "float", 4);
+    w.f32(1.0f);
+
+    w.u8(0);    // end of header
+
+    // Offset table, filled in once the chunk positions are known.
+    size_t table_start = w.data.size();
+    for (int j = 0; j < height; ++j)
+        w.u64(0);
+
+    byte_writer raw;
+    std::vector<unsigned char> packed;
+    for (int j = 0; j < height; ++j) {
+        raw.data.clear();
+        for (int c : channel_index)
+            for (int i = 0; i < width; ++i)
+                raw.f32(rgb[(size_t(j) * width + i) * 3 + c]);
+
+        uint64_t offset = w.data.size();
+        for (int b = 0; b < 8; ++b)
+            w.data[table_start + j*8 + b] = (offset >> (8*b)) & 0xff;
+
+        bool compressed = exr_rle_compress(raw.data, packed);
+        const auto& chunk = compressed ? packed : raw.data;
+        w.i32(j);
+        w.i32(static_cast<int32_t>(chunk.size()));
+        w.bytes(chunk.data(), chunk.size());
+    }
+
+    out.write(reinterpret_cast<const char*>(w.data.data()), w.data.size());
+}
+
+void write_image(std::ostream& out, const framebuffer& fb, image_format format) {
+    if (format == image_format::p3) {
+        fb.write(out);
+        return;
+    }
+
+    auto rgb = resolve_pixels(fb);
+    switch (format) {
+        case image_format::pfm: write_pfm(out, fb.width, fb.height, rgb); break;
+        case image_format::exr: write_exr(out, fb.width, fb.height, rgb); break;
+        default:                write_ppm(out, fb.width, fb.height, rgb); break;
+    }
+}
+
+#endif
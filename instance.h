@@ -0,0 +1,179 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "utility.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "transform.h"
+
+#include <iostream>
+#include <memory>
+
+// Places an object, typically a mesh with its own BVH, in the scene with an
+// affine transform, stored as a matrix together with its inverse. The ray is
+// taken into the object's space once per instance, so the object and its BVH
+// can be shared by any number of instances, each with its own transform and,
+// optionally, its own material. A BVH over the instances then forms the top
+// level of a two-level hierarchy. The bounding box is that of the
+// transformed object rather than the transformed box of the object, which
+// is looser under rotation.
+class instance : public hittable {
+    public:
+        instance(shared_ptr<hittable> object, const mat34& object_to_world, shared_ptr<material> m = nullptr);
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bbox;
+            return hasbox;
+        }
+
+        virtual void surface(const ray& r, hit_data& rec) const override;
+
+        // The material override doesn't matter for visibility.
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            return object->occluded(to_object_space(r), t_min, t_max);
+        }
+
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            return object->transformed_box(t * to_world, output_box);
+        }
+
+        virtual int transform_depth() const override {
+            return 1 + object->transform_depth();
+        }
+
+    private:
+        // Same ray in object space. t is the same along both.
+        ray to_object_space(const ray& r) const {
+            if (translation_only)
+                return r.moved_to(to_object.point(r.origin()));
+            return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+        }
+
+    public:
+        shared_ptr<hittable> object;
+        shared_ptr<material> material_override;     // replaces the object's material if set
+        mat34 to_world;
+        mat34 to_object;
+        bool translation_only;
+        bool hasbox;
+        aabb bbox;
+};
+
+
+instance::instance(shared_ptr<hittable> p, const mat34& object_to_world, shared_ptr<material> m)
+    : object(p), material_override(m), to_world(object_to_world), to_object(inverse(object_to_world)),
+      translation_only(object_to_world.is_translation())
+{
+    hasbox = object->transformed_box(to_world, bbox);
+}
+
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    if (!object->hit(to_object_space(r), t_min, t_max, rec))
+        return false;
+
+    rec.push_transform(this);
+    return true;
+}
+
+
+// The transformed normal faces the same way relative to the transformed ray
+// as the object's normal does to the object space ray, so front_face stays.
+void instance::surface(const ray& r, hit_data& rec) const {
+    --rec.path_size;
+    rec.path[rec.path_size - 1]->surface(to_object_space(r), rec);
+
+    rec.hit_point = to_world.point(rec.hit_point);
+    if (!translation_only)
+        rec.hit_normal = unit_vector(to_object.transposed_vector(rec.hit_normal));
+    if (material_override)
+        rec.material_pointer = material_override.get();
+}
+
+// Replaces a chain of nested translate, rotate_y and instance nodes on top
+// of object by a single instance with the product of their transforms, and
+// adds the number of nodes that made redundant to removed. Of the materials
+// of nested instances, the outermost one wins, as it does when the chain is
+// traced. Anything else is returned as is.
+shared_ptr<hittable> collapse_transforms(shared_ptr<hittable> object, int& removed) {
+    mat34 t = mat34::identity();
+    shared_ptr<material> m;
+    int nodes = 0;
+    while (true) {
+        if (auto moved = std::dynamic_pointer_cast<translate>(object)) {
+            t = t * mat34::translation(moved->offset);
+            object = moved->ptr;
+        } else if (auto rotated = std::dynamic_pointer_cast<rotate_y>(object)) {
+            t = t * rotated->matrix();
+            object = rotated->ptr;
+        } else if (auto placed = std::dynamic_pointer_cast<instance>(object)) {
+            t = t * placed->to_world;
+            if (!m)
+                m = placed->material_override;
+            object = placed->object;
+        } else {
+            break;
+        }
+        ++nodes;
+    }
+
+    if (nodes == 0)
+        return object;
+    removed += nodes - 1;
+    return make_shared<instance>(object, t, m);
+}
+
+// Collapses the transform chains of every object in list, see above.
+void collapse_transforms(hittable_list& list) {
+    int removed = 0;
+    for (auto& object : list.objects)
+        object = collapse_transforms(object, removed);
+    if (removed > 0)
+        std::cerr << "Collapsed " << removed << " nested transform nodes\n";
+}
+
+// Moves the geometry of every object in list that is placed by an instance
+// of its own into place, and puts the object in the list instead of the
+// instance, so that its rays are no longer transformed. Objects shared by
+// several instances, instances with their own material and objects that
+// can't hold the transformed shape keep their instance. Run this before
+// building the list's BVH.
+void freeze_transforms(hittable_list& list) {
+    int instances = 0, removed = 0;
+    for (auto& object : list.objects) {
+        auto placed = std::dynamic_pointer_cast<instance>(object);
+        if (!placed)
+            continue;
+        ++instances;
+        // Held by the list and by placed, and its object only by itself.
+        if (placed.use_count() > 2 || placed->object.use_count() > 1 || placed->material_override)
+            continue;
+        if (placed->object->apply_transform(placed->to_world)) {
+            object = placed->object;
+            ++removed;
+        }
+    }
+    if (instances > 0)
+        std::cerr << "Froze " << removed << " of " << instances << " transform nodes into their geometry\n";
+}
+
+// hit_data records the transforms above the object that was hit so that its
+// surface can be found once the closest hit is known, and has room for
+// max_transform_depth of them. Returns false, with a message, if a ray could
+// pass through more transforms than that on its way to an object in list.
+// Run this after collapse_transforms(), which removes most of the nesting.
+bool check_transform_depth(const hittable_list& list) {
+    int depth = list.transform_depth();
+    if (depth > max_transform_depth) {
+        std::cerr << "Objects are nested in up to " << depth << " transforms, but at most "
+                  << max_transform_depth << " are supported\n";
+        return false;
+    }
+    return true;
+}
+
+#endif
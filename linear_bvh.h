@@ -0,0 +1,365 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <vector>
+
+// One node of a flattened BVH, stored depth first in a single array. The
+// first child of an interior node directly follows it; the second child is at
+// `offset`. A leaf covers `count` primitives starting at `offset` in the
+// primitive order. Bounds are single precision, rounded outwards, so a node
+// is 32 bytes and two fit in a cache line.
+struct linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset;
+    uint16_t count;     // 0 for interior nodes
+    uint8_t axis;       // split axis of interior nodes
+    uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+inline float round_down(double x) {
+    float f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float round_up(double x) {
+    float f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, INFINITY) : f;
+}
+
+// Pointer-free BVH over an abstract set of primitives. It only knows their
+// bounds; what a primitive is and how to intersect it is up to the caller,
+// which passes a leaf function to traverse().
+class linear_bvh {
+    public:
+        linear_bvh() {}
+
+        // Builds the tree over prims, which is reordered in place so that
+        // every leaf covers a contiguous range of it. Large subtrees are
+        // built in parallel.
+        void build(std::vector<bvh_primitive>& prims, const bvh_build_options& options) {
+            nodes.clear();
+            nodes.reserve(2 * prims.size());
+            if (!prims.empty())
+                build_subtree(prims, 0, prims.size(), options, 0, parallel_build_levels(options.threads), nodes);
+            nodes.shrink_to_fit();
+
+            indices.resize(prims.size());
+            for (size_t k = 0; k < prims.size(); ++k)
+                indices[k] = prims[k].index;
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        aabb bounds() const {
+            if (nodes.empty()) return aabb::empty();
+            return node_box(nodes[0]);
+        }
+
+        // Visits the leaves whose boxes the ray enters within [t_min, t_max],
+        // nearer child first. leaf(first, count, t_max) intersects primitives
+        // indices[first .. first+count), shrinks t_max to the closest hit and
+        // returns true if it found one. Returns true if any leaf did.
+        template <typename leaf_function>
+        bool traverse(const ray& r, real t_min, real t_max, const leaf_function& leaf) const {
+            if (nodes.empty())
+                return false;
+
+            uint32_t stack[max_depth];
+            int stack_size = 0;
+            uint32_t current = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const auto& node = nodes[current];
+                if (node_hit(node, r, t_min, t_max)) {
+                    if (node.count > 0) {
+                        if (leaf(node.offset, node.count, t_max))
+                            hit_anything = true;
+                    } else {
+                        // Visit the child on the near side of the split plane
+                        // first and keep the other one for later.
+                        if (r.sign[node.axis]) {
+                            stack[stack_size++] = current + 1;
+                            current = node.offset;
+                        } else {
+                            stack[stack_size++] = node.offset;
+                            current = current + 1;
+                        }
+                        continue;
+                    }
+                }
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+
+            return hit_anything;
+        }
+
+        // Like traverse(), but for any-hit queries: leaf(first, count) returns
+        // true if any of the leaf's primitives is hit within [t_min, t_max],
+        // and the traversal stops there.
+        template <typename leaf_function>
+        bool traverse_any(const ray& r, real t_min, real t_max, const leaf_function& leaf) const {
+            if (nodes.empty())
+                return false;
+
+            uint32_t stack[max_depth];
+            int stack_size = 0;
+            uint32_t current = 0;
+
+            while (true) {
+                const auto& node = nodes[current];
+                if (node_hit(node, r, t_min, t_max)) {
+                    if (node.count > 0) {
+                        if (leaf(node.offset, node.count))
+                            return true;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                        continue;
+                    }
+                }
+                if (stack_size == 0)
+                    return false;
+                current = stack[--stack_size];
+            }
+        }
+
+        // Calls remap(offset, count) with references to the range of every
+        // leaf, so that a caller can point the leaves at its own storage.
+        template <typename remap_function>
+        void remap_leaves(const remap_function& remap) {
+            for (auto& node : nodes)
+                if (node.count > 0)
+                    remap(node.offset, node.count);
+        }
+
+        // Recomputes the bounds of every node, bottom up, after the
+        // primitives have moved, keeping the structure of the tree.
+        // leaf_box(first, count) returns the bounds of a leaf's primitives.
+        template <typename leaf_box_function>
+        void refit(const leaf_box_function& leaf_box) {
+            for (size_t i = nodes.size(); i-- > 0;) {
+                auto& node = nodes[i];
+                aabb box = node.count > 0 ? leaf_box(node.offset, node.count)
+                                          : surrounding_box(node_box(nodes[i + 1]), node_box(nodes[node.offset]));
+                for (int a = 0; a < 3; ++a) {
+                    node.bounds_min[a] = round_down(box.min()[a]);
+                    node.bounds_max[a] = round_up(box.max()[a]);
+                }
+            }
+        }
+
+        // Expected cost of tracing a ray through the tree under the SAH.
+        double sah_cost() const {
+            if (nodes.empty()) return 0;
+            double cost = 0;
+            for (const auto& node : nodes) {
+                double area = node_box(node).surface_area();
+                cost += node.count > 0 ? sah_intersection_cost * node.count * area : sah_traversal_cost * area;
+            }
+            return cost / node_box(nodes[0]).surface_area();
+        }
+
+        // Checks that nodes read back from a file are safe to traverse over
+        // primitive_count primitives: children follow their parent within
+        // the array, leaves stay within the primitives and the tree fits the
+        // traversal stack.
+        bool well_formed(size_t primitive_count) const {
+            std::vector<int> depth(nodes.size(), 0);
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                const auto& node = nodes[i];
+                if (node.count > 0) {
+                    if (size_t(node.offset) + node.count > primitive_count)
+                        return false;
+                    continue;
+                }
+                if (node.offset <= i + 1 || node.offset >= nodes.size() || depth[i] + 1 >= max_depth)
+                    return false;
+                depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+                depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+            }
+            return true;
+        }
+
+    public:
+        // Deeper than this, ranges are split evenly, which bounds the depth of
+        // the tree and so the size of the traversal stack.
+        static const int max_depth = 128;
+        static const int max_sah_depth = 64;
+
+        std::vector<linear_bvh_node> nodes;
+        std::vector<uint32_t> indices;      // primitive order, leaves refer to ranges of it
+
+    private:
+        static aabb node_box(const linear_bvh_node& node) {
+            return aabb(point3(node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]),
+                        point3(node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]));
+        }
+
+        // Same slab test as aabb::hit().
+        static bool node_hit(const linear_bvh_node& node, const ray& r, real t_min, real t_max) {
+            const float* bounds[2] = {node.bounds_min, node.bounds_max};
+            for (int a = 0; a < 3; a++) {
+                auto t0 = (bounds[r.sign[a]][a] - r.orig[a]) * r.inv_dir[a];
+                auto t1 = (bounds[1 - r.sign[a]][a] - r.orig[a]) * r.inv_dir[a];
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+            }
+            return t_min <= t_max;
+        }
+
+        // Appends the nodes of the subtree over prims[start, end) to out,
+        // depth first. Interior node offsets are relative to the start of out.
+        static void build_subtree(
+            std::vector<bvh_primitive>& prims, size_t start, size_t end,
+            const bvh_build_options& options, int depth, int spawn_levels,
+            std::vector<linear_bvh_node>& out
+        ) {
+            size_t index = out.size();
+            out.emplace_back();
+
+            aabb box = primitive_bounds(prims, start, end);
+            size_t count = end - start;
+
+            int axis = 0;
+            size_t mid = start;
+            if (depth >= max_sah_depth) {
+                if (count > static_cast<size_t>(options.max_leaf_size))
+                    mid = start + count/2;
+            } else if (options.split == bvh_split::median) {
+                if (count > 2) {
+                    axis = median_split_axis(start, end);
+                    mid = start + count/2;
+                    std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                        [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                            return a.centroid[axis] < b.centroid[axis];
+                        });
+                }
+            } else {
+                mid = sah_partition(prims, start, end, box, options, axis);
+            }
+
+            // Leaf sizes have to fit the 16-bit count.
+            if (mid == start && count > UINT16_MAX)
+                mid = start + count/2;
+
+            if (mid == start) {
+                // The primitives stay where they are, so the leaf refers to
+                // its own range of the final order.
+                out[index].offset = static_cast<uint32_t>(start);
+                out[index].count = static_cast<uint16_t>(count);
+            } else if (spawn_levels > 0 && count >= min_parallel_build_size) {
+                // The second child goes to another thread with its own node
+                // array, which is appended once both halves are done.
+                std::vector<linear_bvh_node> second;
+                auto second_task = std::async(std::launch::async, [&]() {
+                    second.reserve(2 * (end - mid));
+                    build_subtree(prims, mid, end, options, depth + 1, spawn_levels - 1, second);
+                });
+                build_subtree(prims, start, mid, options, depth + 1, spawn_levels - 1, out);
+                second_task.get();
+
+                auto base = static_cast<uint32_t>(out.size());
+                for (auto node : second) {
+                    if (node.count == 0)
+                        node.offset += base;
+                    out.push_back(node);
+                }
+                out[index].offset = base;
+                out[index].count = 0;
+                out[index].axis = static_cast<uint8_t>(axis);
+            } else {
+                build_subtree(prims, start, mid, options, depth + 1, 0, out);
+                out[index].offset = static_cast<uint32_t>(out.size());
+                out[index].count = 0;
+                out[index].axis = static_cast<uint8_t>(axis);
+                build_subtree(prims, mid, end, options, depth + 1, 0, out);
+            }
+
+            auto& node = out[index];
+            for (int a = 0; a < 3; ++a) {
+                node.bounds_min[a] = round_down(box.min()[a]);
+                node.bounds_max[a] = round_up(box.max()[a]);
+            }
+            node.pad = 0;
+        }
+};
+
+// A BVH over hittables laid out as a pointer-free tree, a linear_bvh or a
+// wide_bvh. The objects are stored in leaf order, so every leaf is a
+// contiguous run of the array.
+template <typename tree_type>
+class basic_flat_bvh : public hittable {
+    public:
+        basic_flat_bvh() {}
+
+        basic_flat_bvh(const hittable_list& list, const bvh_build_options& options, double time0 = 0.0, double time1 = 1.0) {
+            auto prims = make_bvh_primitives(list.objects, time0, time1, options.threads);
+            tree.build(prims, options);
+            objects.reserve(list.objects.size());
+            for (auto index : tree.indices)
+                objects.push_back(list.objects[index]);
+        }
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            return tree.traverse_any(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+                for (uint32_t k = first; k < first + count; ++k)
+                    if (objects[k]->occluded(r, t_min, t_max))
+                        return true;
+                return false;
+            });
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = tree.bounds();
+            return !tree.empty();
+        }
+
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            return transformed_box_of(objects, t, output_box);
+        }
+
+        virtual int transform_depth() const override {
+            return transform_depth_of(objects);
+        }
+
+    public:
+        tree_type tree;
+        std::vector<shared_ptr<hittable>> objects;
+};
+
+template <typename tree_type>
+bool basic_flat_bvh<tree_type>::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    return tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count, real& closest) {
+        bool hit_anything = false;
+        for (uint32_t k = first; k < first + count; ++k) {
+            if (objects[k]->hit(r, t_min, closest, rec)) {
+                hit_anything = true;
+                closest = rec.t;
+            }
+        }
+        return hit_anything;
+    });
+}
+
+typedef basic_flat_bvh<linear_bvh> flat_bvh;
+
+#endif
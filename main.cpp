@@ -8,10 +8,22 @@
 #include "material.h"
 // #include "hittable.h"
 #include "bvh.h"
+#include "accel.h"
 #include "box.h"
 #include "mesh.h"
-
+#include "mesh_loader.h"
+#include "instance.h"
+#include "triangle_mesh.h"
+#include "framebuffer.h"
+#include "render.h"
+#include "progressive.h"
+#include "image_io.h"
+#include "options.h"
+#include "bench.h"
+
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
     hit_data data;
@@ -21,7 +33,7 @@ color ray_color(const ray& r, const color& background, const hittable& world, in
         return color(0,0,0);
 
     // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, data))
+    if (!hit_surface(world, r, min_hit_distance(r), infinity, data))
         return background;
 
     ray scattered;
@@ -34,10 +46,8 @@ color ray_color(const ray& r, const color& background, const hittable& world, in
     return emitted + attenuation * ray_color(scattered, background, world, depth-1);
 }
 
-hittable_list samovar() {
+bool samovar(std::vector<mesh_request>& meshes, const bvh_build_options& bvh, hittable_list& world) {
     hittable_list objects;
-    hittable_list world;
-    mesh m;
 
     auto red   = make_shared<lambertian>(color(.65, .05, .05));
     auto white = make_shared<lambertian>(color(.73, .73, .73));
@@ -54,21 +64,22 @@ hittable_list samovar() {
     objects.add(make_shared<xy_rect>(0, 900, 0, 900, 900, white));
     objects.add(make_shared<xy_rect>(0, 900, 0, 900, -700, white));
 
-    // adding triangles from obj file -- good result and fast
-    auto tri = m.get_triangles(metalic);
-    for (int i = 0; i < tri.size(); i++) {
-        objects.add(make_shared<translate>(tri[i], vec3(400,250,370)));
-    }
+    // adding every obj file as one indexed mesh with its own BVH
+    apply_mesh_defaults(meshes, metalic, vec3(400,250,370));
+    if (!load_meshes(meshes, bvh, objects))
+        return false;
 
-    world.add(make_shared<bvh_node>(objects, 0.0, 1.0));
+    collapse_transforms(objects);
+    freeze_transforms(objects);
+    if (!check_transform_depth(objects))
+        return false;
+    world.add(build_bvh(objects, bvh));
 
-    return world;
+    return true;
 }
 
-hittable_list bunny() {
+bool bunny(std::vector<mesh_request>& meshes, const bvh_build_options& bvh, hittable_list& world) {
     hittable_list objects;
-    hittable_list world;
-    mesh m;
 
     auto white = make_shared<lambertian>(color(.73, .73, .73));
     auto green = make_shared<lambertian>(color(.27, .51, .71));
@@ -85,21 +96,22 @@ hittable_list bunny() {
     objects.add(make_shared<xz_rect>(0, 555, 0, 1500, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 1500, purple));
 
-    // adding triangles from obj file -- good result and fast
-    auto tri = m.get_triangles(glass);
-    for (int i = 0; i < tri.size(); i++) {
-        objects.add(make_shared<translate>(tri[i], vec3(250,250,870)));
-    }
+    // adding every obj file as one indexed mesh with its own BVH
+    apply_mesh_defaults(meshes, glass, vec3(250,250,870));
+    if (!load_meshes(meshes, bvh, objects))
+        return false;
 
-    world.add(make_shared<bvh_node>(objects, 0.0, 1.0));
+    collapse_transforms(objects);
+    freeze_transforms(objects);
+    if (!check_transform_depth(objects))
+        return false;
+    world.add(build_bvh(objects, bvh));
 
-    return world;
+    return true;
 }
 
-hittable_list shapes() {
+bool shapes(const bvh_build_options& bvh, hittable_list& world) {
     hittable_list objects;
-    hittable_list world;
-    mesh m;
 
     auto red   = make_shared<lambertian>(color(.55, .15, .25));
     auto white = make_shared<lambertian>(color(.73, .73, .73));
@@ -130,15 +142,17 @@ hittable_list shapes() {
     objects.add(make_shared<sphere>(vec3(330,310,200), 70, glass));
     objects.add(make_shared<box>(vec3(250,0,120), vec3(410,240,280), orange));
 
-    world.add(make_shared<bvh_node>(objects, 0.0, 1.0));
+    collapse_transforms(objects);
+    freeze_transforms(objects);
+    if (!check_transform_depth(objects))
+        return false;
+    world.add(build_bvh(objects, bvh));
 
-    return world;
+    return true;
 }
 
-hittable_list cornell_box() {
+bool cornell_box(std::vector<mesh_request>& meshes, const bvh_build_options& bvh, hittable_list& world) {
     hittable_list objects;
-    hittable_list world;
-    mesh m;
 
     auto red   = make_shared<lambertian>(color(.65, .05, .05));
     auto white = make_shared<lambertian>(color(.73, .73, .73));
@@ -153,19 +167,74 @@ hittable_list cornell_box() {
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
-    // adding triangles from obj file -- good result and fast
-    auto tri = m.get_triangles(glass);
-    for (int i = 0; i < tri.size(); i++) {
-        objects.add(make_shared<translate>(tri[i], vec3(400,250,370)));
-    }
+    // adding every obj file as one indexed mesh with its own BVH
+    apply_mesh_defaults(meshes, glass, vec3(400,250,370));
+    if (!load_meshes(meshes, bvh, objects))
+        return false;
 
-    world.add(make_shared<bvh_node>(objects, 0.0, 1.0));
+    collapse_transforms(objects);
+    freeze_transforms(objects);
+    if (!check_transform_depth(objects))
+        return false;
+    world.add(build_bvh(objects, bvh));
 
-    return world;
+    return true;
 }
 
 
-int main() {
+int main(int argc, char* argv[]) {
+    render_options opts;
+    if (!parse_options(argc, argv, opts))
+        return 1;
+
+    image_format format = opts.output_path.empty() ? image_format::ppm : format_from_path(opts.output_path);
+    if (!opts.format.empty() && !parse_image_format(opts.format, format)) {
+        std::cerr << "Unknown image format: " << opts.format << "\n";
+        return 1;
+    }
+
+    bvh_build_options bvh;
+    bvh.max_leaf_size = opts.leaf_size;
+    bvh.threads = opts.threads;
+    if (!parse_bvh_split(opts.bvh, bvh.split)) {
+        std::cerr << "Unknown BVH builder: " << opts.bvh << "\n";
+        return 1;
+    }
+    if (!parse_bvh_layout(opts.bvh_layout, bvh.layout)) {
+        std::cerr << "Unknown BVH layout: " << opts.bvh_layout << "\n";
+        return 1;
+    }
+    if (!parse_triangle_test(opts.triangle, triangle_method)) {
+        std::cerr << "Unknown triangle test: " << opts.triangle << "\n";
+        return 1;
+    }
+    if (opts.self_test)
+        return run_self_tests() ? 0 : 1;
+    if (opts.check_bvh_rays > 0)
+        return check_bvh_layouts(opts.check_bvh_rays, bvh) ? 0 : 1;
+
+    // Meshes, stdin unless given with --mesh
+    std::vector<mesh_request> meshes(std::max<size_t>(1, opts.meshes.size()));
+    meshes[0].path = "-";
+    for (size_t i = 0; i < opts.meshes.size(); ++i) {
+        if (!parse_mesh_request(opts.meshes[i], meshes[i])) {
+            std::cerr << "Invalid mesh: " << opts.meshes[i] << "\n";
+            return 1;
+        }
+    }
+    for (auto& request : meshes)
+        request.use_cache = opts.mesh_cache;
+
+    if (opts.compile) {
+        if (opts.meshes.empty()) {
+            std::cerr << "--compile needs the OBJ files to compile given with --mesh.\n";
+            return 1;
+        }
+        for (const auto& request : meshes)
+            if (!compile_mesh(request.path, opts.threads))
+                return 1;
+        return 0;
+    }
 
     // Image
     // const auto aspect_ratio = 16.0 / 9.0;
@@ -173,12 +242,15 @@ int main() {
     // const auto aspect_ratio = 1.0;
     const int image_width = 200;
     const int image_height = static_cast<int>(image_width / aspect_ratio);
-    const int samples_per_pixel = 100; //could be higher
+    const int samples_per_pixel = opts.samples > 0 ? opts.samples : 100; //could be higher
     const int max_depth = 5; //should be 3-5... only helps with reflection refraction
     color background(0,0,0);
 
     // cornell_box_basic
-    // auto world = cornell_box();
+    // auto scene_name = "cornell_box";
+    // hittable_list world;
+    // if (!cornell_box(meshes, bvh, world))
+    //     return 1;
     // auto lookfrom = point3(278, 278, -800);
     // auto lookat = point3(278, 278, 0);
     // vec3 vup(0,1,0);
@@ -187,7 +259,10 @@ int main() {
     // auto vfov = 40.0;
 
     // samovar9.obj
-    auto world = samovar();
+    auto scene_name = "samovar";
+    hittable_list world;
+    if (!samovar(meshes, bvh, world))
+        return 1;
     auto lookfrom = point3(300, 140, -600);
     auto lookat = point3(380, 280, 0);
     vec3 vup(0,1,0);
@@ -196,7 +271,10 @@ int main() {
     auto vfov = 50.0;
 
     // bunnybig2.obj
-    // auto world = bunny();
+    // auto scene_name = "bunny";
+    // hittable_list world;
+    // if (!bunny(meshes, bvh, world))
+    //     return 1;
     // auto lookfrom = point3(265, 450, -200);
     // auto lookat = point3(310, 380, 200);
     // vec3 vup(0,1,0);
@@ -205,7 +283,10 @@ int main() {
     // auto vfov = 40.0;
 
     // shapes
-    // auto world = shapes();
+    // auto scene_name = "shapes";
+    // hittable_list world;
+    // if (!shapes(bvh, world))
+    //     return 1;
     // auto lookfrom = point3(265, 450, -250);
     // auto lookat = point3(180, 350, 200);
     // vec3 vup(0,1,0);
@@ -217,24 +298,77 @@ int main() {
 
     camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
 
+    if (opts.bench_rays > 0) {
+        run_traversal_benchmark(world, cam, opts.bench_rays);
+        return 0;
+    }
+
     // Render
 
-    //This line is important for ppm images
-    std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-
-    for (int j = 0; j < image_height; ++j) {
-        std::cerr << "\rScanlines remaining: " << image_height << ' ' <<j << ' ' << std::flush;
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width-1);
-                auto v = (j + random_double()) / (image_height-1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, max_depth);
-            }
-            write_color(std::cout, pixel_color, samples_per_pixel);
-        }
+    framebuffer fb(image_width, image_height);
+
+    // Returns sample number s of pixel (i, j). Each sample is seeded by its
+    // index, so resumed renders continue exactly where they left off.
+    auto trace_sample = [&](int i, int j, uint32_t s) {
+        seed_sample(j * image_width + i, s);
+        auto u = (i + random_double()) / (image_width-1);
+        auto v = (j + random_double()) / (image_height-1);
+        ray r = cam.get_ray(u, v);
+        return ray_color(r, background, world, max_depth);
+    };
+
+    if (!opts.progressive) {
+        render_tiles(fb, opts.threads, opts.tile_size, samples_per_pixel, trace_sample);
+    } else {
+        // Everything the samples depend on besides the image size, so that a
+        // checkpoint of another scene, camera or configuration isn't resumed.
+        std::ostringstream scene;
+        scene.precision(17);
+        scene << scene_name << ' ' << lookfrom << ' ' << lookat << ' ' << vup << ' ' << vfov << ' ' << aspect_ratio
+              << ' ' << aperture << ' ' << dist_to_focus << ' ' << max_depth << ' ' << background << ' '
+              << sizeof(real) << ' ' << opts.bvh << ' ' << opts.bvh_layout << ' ' << opts.leaf_size << ' '
+              << opts.triangle;
+        for (const auto& spec : opts.meshes)
+            scene << ' ' << spec;
+        for (const auto& request : meshes)
+            scene << ' ' << request.checksum;
+        std::string description = scene.str();
+        auto scene_id = mesh_file_checksum(description.data(), description.size());
+
+        if (!opts.resume_path.empty() && !load_checkpoint(fb, opts.resume_path, scene_id))
+            return 1;
+
+        progressive_settings settings;
+        settings.scene_id = scene_id;
+        settings.threads = opts.threads;
+        settings.tile_size = opts.tile_size;
+        settings.samples_per_pixel = samples_per_pixel;
+        settings.pass_samples = opts.pass_samples;
+        settings.checkpoint_interval = opts.checkpoint_interval;
+        settings.checkpoint_path = opts.checkpoint_path;
+        settings.adaptive_threshold = opts.adaptive_threshold;
+        settings.min_samples = opts.min_samples;
+        settings.max_samples = opts.max_samples > 0 ? opts.max_samples : 4 * samples_per_pixel;
+
+        if (!render_progressive(fb, settings, trace_sample))
+            std::cerr << "\nInterrupted, writing partial image.\n";
+    }
+    report_traversal_stats("\nRender");
+
+    if (opts.output_path.empty()) {
+        write_image(std::cout, fb, format);
+    } else {
+        std::ofstream image(opts.output_path, std::ios::binary);
+        write_image(image, fb, format);
     }
 
+    if (!opts.sample_map_path.empty()) {
+        std::ofstream sample_map(opts.sample_map_path, std::ios::binary);
+        fb.write_sample_map(sample_map);
+    }
+
+    if (!opts.compare_path.empty() && !compare_to_reference(fb, opts.compare_path))
+        return 1;
+
     std::cerr << "\nDone.\n";
 }
@@ -4,6 +4,8 @@
 #include "utility.h"
 #include "hittable.h" // not sure if includeing this is right
 
+#include <string>
+
 struct hit_data;
 
 class material {
@@ -133,4 +135,17 @@ class diffuse_light : public material  {
         color emit;
 };
 
+// Materials that can be picked by name on the command line: white, red,
+// green, metal, mirror, glass and light. Returns nullptr for other names.
+shared_ptr<material> material_by_name(const std::string& name) {
+    if (name == "white")  return make_shared<lambertian>(color(.73, .73, .73));
+    if (name == "red")    return make_shared<lambertian>(color(.65, .05, .05));
+    if (name == "green")  return make_shared<lambertian>(color(.12, .45, .15));
+    if (name == "metal")  return make_shared<metal>(color(.72, .45, .2), 0.3);
+    if (name == "mirror") return make_shared<mirror>(color(.30, .05, .23));
+    if (name == "glass")  return make_shared<dielectric>(1.5);
+    if (name == "light")  return make_shared<diffuse_light>(color(15, 15, 15));
+    return nullptr;
+}
+
 #endif
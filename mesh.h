@@ -2,6 +2,7 @@
 #define MESH_H
 
 #include "hittable.h"
+#include "obj_loader.h"
 #include "triangle.h"
 
 #include <memory>
@@ -23,7 +24,32 @@ class mesh : public hittable {
             return triangles;
         }
 
+        // Reads the mesh from stdin as indexed geometry instead of triangles,
+        // see load_obj().
+        mesh_data get_mesh_data() {
+            mesh_data data;
+            load_obj("-", data);
+            return data;
+        }
+
         void load(shared_ptr<material> m) {
+            parse();
+
+            for (int i = 0; i < faces_info.size(); ++i) {
+                auto vert0Index = faces_info[i][0] - 1 ;
+                auto vert1Index = faces_info[i][2] - 1;
+                auto vert2Index = faces_info[i][4] - 1 ;
+                auto normal0Index = faces_info[i][1] - 1;
+                auto normal1Index = faces_info[i][3] - 1;
+                auto normal2Index = faces_info[i][5] - 1;
+                auto tri = make_shared<triangle>(vertices[vert0Index], vertices[vert1Index], vertices[vert2Index], m, normals[normal0Index], normals[normal1Index], normals[normal2Index]);
+                triangles.push_back(tri);
+
+            }
+         }
+
+        // Reads the OBJ file on stdin into vertices, normals and faces_info.
+        void parse() {
             const int MAX_BUFFER_SIZE = 4096;
             char buffer[MAX_BUFFER_SIZE];
             while (std::cin.getline(buffer, MAX_BUFFER_SIZE)){
@@ -79,22 +105,17 @@ class mesh : public hittable {
                     faces_info.push_back(f);
                 }
             }
-
-            for (int i = 0; i < faces_info.size(); ++i) {
-                auto vert0Index = faces_info[i][0] - 1 ;
-                auto vert1Index = faces_info[i][2] - 1;
-                auto vert2Index = faces_info[i][4] - 1 ;
-                auto normal0Index = faces_info[i][1] - 1;
-                auto normal1Index = faces_info[i][3] - 1;
-                auto normal2Index = faces_info[i][5] - 1;
-                auto tri = make_shared<triangle>(vertices[vert0Index], vertices[vert1Index], vertices[vert2Index], m, normals[normal0Index], normals[normal1Index], normals[normal2Index]);
-                triangles.push_back(tri);
-
-            }
-         }
+        }
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& data) const override;
+            const ray& r, real t_min, real t_max, hit_data& data) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override {
+            for (const auto& object : triangles)
+                if (object->occluded(r, t_min, t_max))
+                    return true;
+            return false;
+        }
 
         virtual bool bounding_box(
             double time0, double time1, aabb& output_box) const override;
@@ -109,7 +130,7 @@ class mesh : public hittable {
         std::vector<std::vector<unsigned>> faces_info;
 };
 
-bool mesh::hit(const ray& r, double t_min, double t_max, hit_data& data) const {
+bool mesh::hit(const ray& r, real t_min, real t_max, hit_data& data) const {
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
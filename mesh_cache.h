@@ -0,0 +1,232 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "utility.h"
+
+#include "array_view.h"
+#include "obj_loader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Compiled mesh files
+
+// mesh_data as it is in memory, so that a mapped file can be used without
+// parsing or copying. Layout (native endianness):
+//   mesh_file_header
+//   float    positions[vertex_count*3]
+//   float    normals[vertex_count*3]       only if has_normals
+//   uint32_t indices[triangle_count*3]
+struct mesh_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t has_normals;
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+    uint64_t source_size;       // size of the OBJ file it was compiled from
+    int64_t source_time;        // and its modification time in nanoseconds
+    uint64_t checksum;          // of everything after the header
+};
+
+const char mesh_file_magic[8] = {'R','T','M','E','S','H','\0','\0'};
+const uint32_t mesh_file_version = 1;
+
+// Compiled meshes are cached next to their OBJ file, with this appended to
+// its name. Files with this extension are also loaded as compiled meshes.
+const std::string mesh_file_extension = ".rtmesh";
+
+uint64_t mesh_file_checksum(const char* p, size_t size) {
+    uint64_t hash = size;
+    size_t k = 0;
+    for (; k + 8 <= size; k += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + k, sizeof(word));
+        hash = sample_rng::mix(hash ^ word);
+    }
+    for (; k < size; ++k)
+        hash = sample_rng::mix(hash ^ static_cast<unsigned char>(p[k]));
+    return hash;
+}
+
+// Hash of the vertices, normals and triangles of data, which tells whether
+// two loads of a mesh gave the same geometry.
+uint64_t mesh_data_checksum(const mesh_data& data) {
+    uint64_t hash = mesh_file_checksum(reinterpret_cast<const char*>(data.positions.data()),
+                                       sizeof(float) * data.positions.size());
+    hash = sample_rng::mix(hash ^ mesh_file_checksum(reinterpret_cast<const char*>(data.normals.data()),
+                                                     sizeof(float) * data.normals.size()));
+    return sample_rng::mix(hash ^ mesh_file_checksum(reinterpret_cast<const char*>(data.indices.data()),
+                                                     sizeof(uint32_t) * data.indices.size()));
+}
+
+// Size and modification time of the file at path, which tell whether a
+// cached compiled mesh is still up to date.
+bool file_stamp(const std::string& path, uint64_t& size, int64_t& time) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+    size = static_cast<uint64_t>(info.st_size);
+    time = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+// Writes data to path atomically through a temporary file, like checkpoints.
+bool write_mesh_file(const mesh_data& data, const std::string& path, uint64_t source_size, int64_t source_time) {
+    mesh_file_header header;
+    std::memcpy(header.magic, mesh_file_magic, sizeof(header.magic));
+    header.version = mesh_file_version;
+    header.has_normals = data.normals.empty() ? 0 : 1;
+    header.vertex_count = data.vertex_count();
+    header.triangle_count = data.triangle_count();
+    header.source_size = source_size;
+    header.source_time = source_time;
+
+    // The checksum runs over the arrays as they follow each other in the file.
+    std::string body;
+    body.reserve(sizeof(float) * (data.positions.size() + data.normals.size()) + sizeof(uint32_t) * data.indices.size());
+    body.append(reinterpret_cast<const char*>(data.positions.data()), sizeof(float) * data.positions.size());
+    body.append(reinterpret_cast<const char*>(data.normals.data()), sizeof(float) * data.normals.size());
+    body.append(reinterpret_cast<const char*>(data.indices.data()), sizeof(uint32_t) * data.indices.size());
+    header.checksum = mesh_file_checksum(body.data(), body.size());
+
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    FILE* file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Could not open " << tmp_path << " for writing.\n";
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+           && std::fwrite(body.data(), 1, body.size(), file) == body.size();
+    ok = (std::fclose(file) == 0) && ok;
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write " << path << ".\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Maps the compiled mesh at path and points data into the mapping, which
+// stays mapped until the last array referring to it is gone. Fails if the
+// file is damaged or, with a source stamp, was compiled from a different
+// version of the OBJ file.
+bool read_mesh_file(const std::string& path, mesh_data& data, const uint64_t* source_size = nullptr,
+                    const int64_t* source_time = nullptr) {
+    auto file = make_shared<file_view>();
+    if (!file->open(path))
+        return false;
+    file->advise(MADV_NORMAL);
+
+    mesh_file_header header;
+    if (file->size() < sizeof(header)) {
+        std::cerr << path << " is not a compiled mesh.\n";
+        return false;
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, mesh_file_magic, sizeof(header.magic)) != 0 || header.version != mesh_file_version) {
+        std::cerr << path << " is not a compiled mesh of this version.\n";
+        return false;
+    }
+    if (source_size && (header.source_size != *source_size || header.source_time != *source_time))
+        return false;
+
+    // Neither array can be larger than the file, which bounds the counts
+    // before they are multiplied. Triangles are numbered with 32 bits.
+    const uint64_t max_count = file->size() / (3 * sizeof(float));
+    if (header.vertex_count > max_count || header.triangle_count > max_count
+        || header.triangle_count > UINT32_MAX) {
+        std::cerr << path << " is damaged.\n";
+        return false;
+    }
+
+    size_t position_count = 3 * header.vertex_count;
+    size_t normal_count = header.has_normals ? position_count : 0;
+    size_t index_count = 3 * header.triangle_count;
+    size_t body_size = sizeof(float) * (position_count + normal_count) + sizeof(uint32_t) * index_count;
+    const char* body = file->data() + sizeof(header);
+    if (file->size() != sizeof(header) + body_size || mesh_file_checksum(body, body_size) != header.checksum) {
+        std::cerr << path << " is damaged.\n";
+        return false;
+    }
+
+    // The checksum only shows that the file is as it was written. Indices
+    // past the vertices would be read out of bounds by the BVH build and the
+    // triangle tests, so they are checked too.
+    auto positions = reinterpret_cast<const float*>(body);
+    auto indices = reinterpret_cast<const uint32_t*>(positions + position_count + normal_count);
+    for (size_t k = 0; k < index_count; ++k) {
+        if (indices[k] >= header.vertex_count) {
+            std::cerr << path << " refers to vertex " << indices[k] << " of " << header.vertex_count << ".\n";
+            return false;
+        }
+    }
+
+    data.positions = array_view<float>(positions, position_count, file);
+    data.normals = array_view<float>(positions + position_count, normal_count, file);
+    data.indices = array_view<uint32_t>(indices, index_count, file);
+    return true;
+}
+
+// Loads the mesh at path: a compiled mesh if it ends in mesh_file_extension,
+// otherwise an OBJ file ("-" for stdin). With use_cache, an OBJ file is
+// compiled into a cache file next to it the first time, and later loads map
+// the cache instead as long as the OBJ file keeps its size and time.
+bool load_mesh(const std::string& path, mesh_data& data, int threads = 0, bool use_cache = true) {
+    auto started = std::chrono::steady_clock::now();
+    bool compiled = path.size() > mesh_file_extension.size()
+                 && path.compare(path.size() - mesh_file_extension.size(), std::string::npos, mesh_file_extension) == 0;
+    std::string cache_path = path + mesh_file_extension;
+    uint64_t source_size = 0;
+    int64_t source_time = 0;
+    use_cache = use_cache && !compiled && path != "-" && file_stamp(path, source_size, source_time);
+
+    bool loaded = false;
+    if (compiled) {
+        if (!read_mesh_file(path, data))
+            return false;
+        loaded = true;
+    } else if (use_cache && access(cache_path.c_str(), F_OK) == 0) {
+        loaded = read_mesh_file(cache_path, data, &source_size, &source_time);
+    }
+
+    if (loaded) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+        std::ostringstream report;
+        report << "Compiled mesh " << (compiled ? path : cache_path) << ": " << data.triangle_count()
+               << " triangles in " << elapsed.count() << " ms\n";
+        std::cerr << report.str();
+        return true;
+    }
+
+    if (!load_obj(path, data, threads))
+        return false;
+    if (use_cache)
+        write_mesh_file(data, cache_path, source_size, source_time);
+    return true;
+}
+
+// Compiles the OBJ file at path into path + mesh_file_extension.
+bool compile_mesh(const std::string& path, int threads = 0) {
+    uint64_t source_size;
+    int64_t source_time;
+    mesh_data data;
+    if (!file_stamp(path, source_size, source_time)) {
+        std::cerr << "Could not open " << path << ".\n";
+        return false;
+    }
+    if (!load_obj(path, data, threads) || !write_mesh_file(data, path + mesh_file_extension, source_size, source_time))
+        return false;
+    std::cerr << "Wrote " << path + mesh_file_extension << "\n";
+    return true;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "hittable.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh_cache.h"
+#include "obj_loader.h"
+#include "parallel.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// An OBJ file to load into a scene with the material its triangles get and
+// its placement: rotated by `rotation` degrees about the y axis, then moved
+// by `offset`. Requests without a material or placement get the scene's,
+// see apply_mesh_defaults().
+struct mesh_request {
+    std::string path;                       // "-" reads stdin
+    shared_ptr<material> material_pointer;
+    bool placed = false;                    // offset and rotation were given
+    vec3 offset;
+    double rotation = 0;
+    bool use_cache = true;                  // mesh and BVH caches, see load_mesh()
+    uint64_t checksum = 0;                  // of the loaded geometry, set by load_meshes()
+};
+
+// Parses FILE[:MATERIAL[:X,Y,Z[:DEGREES]]] into request, where MATERIAL is a
+// name known to material_by_name() and may be empty to keep the scene's.
+bool parse_mesh_request(const std::string& spec, mesh_request& request) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t colon = spec.find(':', start);
+        fields.push_back(spec.substr(start, colon - start));
+        if (colon == std::string::npos)
+            break;
+        start = colon + 1;
+    }
+
+    request = mesh_request();
+    request.path = fields[0];
+    if (request.path.empty() || fields.size() > 4)
+        return false;
+
+    if (fields.size() > 1 && !fields[1].empty()) {
+        request.material_pointer = material_by_name(fields[1]);
+        if (!request.material_pointer) {
+            std::cerr << "Unknown material: " << fields[1] << "\n";
+            return false;
+        }
+    }
+
+    if (fields.size() > 2) {
+        const char* p = fields[2].c_str();
+        for (int a = 0; a < 3; ++a) {
+            char* end;
+            request.offset[a] = std::strtod(p, &end);
+            if (end == p || *end != (a < 2 ? ',' : '\0'))
+                return false;
+            p = end + (a < 2 ? 1 : 0);
+        }
+        request.placed = true;
+    }
+
+    if (fields.size() > 3) {
+        char* end;
+        request.rotation = std::strtod(fields[3].c_str(), &end);
+        if (end == fields[3].c_str() || *end != '\0')
+            return false;
+    }
+    return true;
+}
+
+// Gives requests that did not pick a material or a placement the scene's.
+void apply_mesh_defaults(std::vector<mesh_request>& requests, shared_ptr<material> m, const vec3& offset) {
+    for (auto& request : requests) {
+        if (!request.material_pointer)
+            request.material_pointer = m;
+        if (!request.placed)
+            request.offset = offset;
+    }
+}
+
+// Loads the meshes of all requests and adds each request to objects as an
+// instance with its own transform and material, in request order. Every file
+// is loaded and gets its BVH once, however many requests name it. Each
+// worker parses a file and then builds its BVH before taking the next file,
+// so while one mesh is being built the next one is already being parsed.
+// With fewer files than threads, the threads left over help parse and build
+// each file. Sets the checksum of every request to that of its geometry.
+bool load_meshes(std::vector<mesh_request>& requests, const bvh_build_options& options,
+                 hittable_list& objects) {
+    auto started = std::chrono::steady_clock::now();
+
+    // The first request for each file says how it is loaded.
+    std::map<std::string, size_t> file_of_path;
+    std::vector<size_t> file_of_request(requests.size());
+    std::vector<const mesh_request*> files;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        auto inserted = file_of_path.insert(std::make_pair(requests[i].path, files.size()));
+        if (inserted.second)
+            files.push_back(&requests[i]);
+        file_of_request[i] = inserted.first->second;
+    }
+
+    int threads = worker_count(options.threads);
+    int workers = std::min<int>(threads, static_cast<int>(files.size()));
+    bvh_build_options per_mesh = options;
+    per_mesh.threads = std::max(1, threads / std::max(1, workers));
+
+    std::vector<shared_ptr<hittable>> loaded(files.size());
+    std::vector<uint64_t> checksums(files.size());
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    auto work = [&]() {
+        for (size_t f = next++; f < files.size(); f = next++) {
+            const mesh_request& request = *files[f];
+            mesh_data data;
+            if (!load_mesh(request.path, data, per_mesh.threads, request.use_cache)) {
+                failed = true;
+                continue;
+            }
+            if (data.triangle_count() == 0) {
+                std::cerr << request.path << " contains no triangles.\n";
+                failed = true;
+                continue;
+            }
+            checksums[f] = mesh_data_checksum(data);
+            bool cache_bvh = request.use_cache && request.path != "-";
+            loaded[f] = make_indexed_mesh(std::move(data), request.material_pointer, per_mesh,
+                                          cache_bvh ? bvh_cache_path(request.path) : std::string());
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int w = 1; w < workers; ++w)
+        pool.emplace_back(work);
+    work();
+    for (auto& thread : pool)
+        thread.join();
+
+    if (failed)
+        return false;
+
+    // Only the instances hold the meshes from here on, see
+    // freeze_transforms().
+    for (size_t i = 0; i < requests.size(); ++i) {
+        mesh_request& request = requests[i];
+        // The mesh already has the material of the first request for it.
+        size_t f = file_of_request[i];
+        request.checksum = checksums[f];
+        auto placement = mat34::translation(request.offset) * mat34::rotation_y(request.rotation);
+        auto m = request.material_pointer != files[f]->material_pointer ? request.material_pointer : nullptr;
+        objects.add(make_shared<instance>(loaded[f], placement, m));
+    }
+
+    if (requests.size() > 1) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+        std::cerr << "Loaded " << files.size() << " meshes on " << workers << " threads and placed "
+                  << requests.size() << " instances in " << elapsed.count() << " ms\n";
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,466 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "utility.h"
+
+#include "array_view.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Indexed triangle geometry. Every vertex is stored once in single precision
+// and a triangle is three 32-bit vertex indices. normals is either empty or
+// holds one unit normal per vertex. The arrays may point straight into a
+// mapped mesh cache file, see mesh_cache.h.
+struct mesh_data {
+    array_view<float> positions;        // x, y, z per vertex
+    array_view<float> normals;          // x, y, z per vertex, or empty
+    array_view<uint32_t> indices;       // three vertices per triangle
+
+    size_t vertex_count() const { return positions.size() / 3; }
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+// Read-only contents of a whole file. Regular files are memory mapped;
+// anything else, such as a pipe on stdin, is read into memory.
+class file_view {
+    public:
+        file_view() {}
+        file_view(const file_view&) = delete;
+        file_view& operator=(const file_view&) = delete;
+
+        ~file_view() {
+            if (mapped)
+                munmap(const_cast<char*>(mapped), length);
+        }
+
+        // Reads the file open as fd, which is left open.
+        bool open(int fd, const std::string& name) {
+            struct stat info;
+            if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+                length = static_cast<size_t>(info.st_size);
+                void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    mapped = static_cast<const char*>(p);
+                    madvise(p, length, MADV_SEQUENTIAL);
+                    return true;
+                }
+            }
+
+            length = 0;
+            char block[1 << 16];
+            ssize_t n;
+            while ((n = read(fd, block, sizeof(block))) > 0)
+                buffer.insert(buffer.end(), block, block + n);
+            if (n < 0) {
+                std::cerr << "Could not read " << name << ".\n";
+                return false;
+            }
+            return true;
+        }
+
+        // Reads the file at path; "-" is stdin.
+        bool open(const std::string& path) {
+            if (path == "-")
+                return open(STDIN_FILENO, "stdin");
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "Could not open " << path << ".\n";
+                return false;
+            }
+            bool ok = open(fd, path);
+            close(fd);
+            return ok;
+        }
+
+        // Passes advice such as MADV_NORMAL on to madvise() if the file is
+        // mapped; mapped files are read sequentially by default.
+        void advise(int advice) const {
+            if (mapped)
+                madvise(const_cast<char*>(mapped), length, advice);
+        }
+
+        const char* data() const { return mapped ? mapped : buffer.data(); }
+        size_t size() const { return mapped ? length : buffer.size(); }
+
+    private:
+        const char* mapped = nullptr;
+        size_t length = 0;
+        std::vector<char> buffer;
+};
+
+// Non-allocating parsing of OBJ text. Every function takes the cursor p and
+// the end of the text, and leaves p after what it read.
+
+inline bool obj_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline void skip_space(const char*& p, const char* end) {
+    while (p < end && obj_space(*p))
+        ++p;
+}
+
+inline void skip_line(const char*& p, const char* end) {
+    const void* newline = std::memchr(p, '\n', end - p);
+    p = newline ? static_cast<const char*>(newline) + 1 : end;
+}
+
+// Parses a decimal number with optional sign, fraction and exponent. Up to 19
+// significant digits with a decimal exponent of at most 22 are converted
+// exactly with one multiplication or division, which is what OBJ exporters
+// write; anything longer goes through strtod.
+bool parse_real(const char*& p, const char* end, double& value) {
+    static const double powers[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    skip_space(p, end);
+    const char* start = p;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        ++p;
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any = false;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa > 0;
+        } else {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa > 0;
+                --exponent;
+            }
+        }
+    }
+    if (!any)
+        return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* e = p + 1;
+        bool negative_exponent = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+'))
+            ++e;
+        int written = 0;
+        bool exponent_digits = false;
+        for (; e < end && *e >= '0' && *e <= '9'; ++e, exponent_digits = true)
+            written = std::min(written * 10 + (*e - '0'), 10000);
+        if (exponent_digits) {
+            exponent += negative_exponent ? -written : written;
+            p = e;
+        }
+    }
+
+    if (mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+        value = static_cast<double>(mantissa);
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+    } else {
+        char token[64];
+        size_t n = std::min<size_t>(p - start, sizeof(token) - 1);
+        std::memcpy(token, start, n);
+        token[n] = '\0';
+        value = std::strtod(token, nullptr);
+    }
+    if (negative)
+        value = -value;
+    return true;
+}
+
+// Parses an OBJ index: 1-based, or negative to count back from the latest
+// element.
+inline bool parse_index(const char*& p, const char* end, int64_t& index) {
+    bool negative = p < end && *p == '-';
+    if (negative)
+        ++p;
+    if (p == end || *p < '0' || *p > '9')
+        return false;
+    index = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+        index = std::min<int64_t>(index * 10 + (*p - '0'), INT32_MAX);
+    if (negative)
+        index = -index;
+    return index != 0;
+}
+
+const int64_t no_normal = INT64_MIN;
+
+// What one chunk of the file contains. Face corners refer to vertices and
+// normals by 0-based index in the whole file, except those listed in
+// relative_vertices and relative_normals, which were written as negative
+// indices and are still relative to the first element of the chunk.
+struct obj_chunk {
+    std::vector<double> positions;
+    std::vector<double> normals;
+    std::vector<int64_t> corner_vertices;   // three per triangle
+    std::vector<int64_t> corner_normals;    // three per triangle, no_normal without one
+    std::vector<size_t> relative_vertices;
+    std::vector<size_t> relative_normals;
+    size_t bad_lines = 0;
+};
+
+// Parses the lines in [p, end), which start at the beginning of a line. Only
+// v, vn and f are read; faces with more than three corners are split into a
+// fan of triangles. A corner is v, v/vt, v//vn or v/vt/vn.
+void parse_obj_chunk(const char* p, const char* end, obj_chunk& chunk) {
+    struct corner { int64_t v, n; bool relative_v, relative_n; };
+    std::vector<corner> face;
+
+    while (p < end) {
+        skip_space(p, end);
+        if (p + 1 < end && p[0] == 'v' && obj_space(p[1])) {
+            p += 2;
+            double xyz[3];
+            if (parse_real(p, end, xyz[0]) && parse_real(p, end, xyz[1]) && parse_real(p, end, xyz[2]))
+                chunk.positions.insert(chunk.positions.end(), xyz, xyz + 3);
+            else
+                ++chunk.bad_lines;
+        } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && obj_space(p[2])) {
+            p += 3;
+            double xyz[3];
+            if (parse_real(p, end, xyz[0]) && parse_real(p, end, xyz[1]) && parse_real(p, end, xyz[2]))
+                chunk.normals.insert(chunk.normals.end(), xyz, xyz + 3);
+            else
+                ++chunk.bad_lines;
+        } else if (p + 1 < end && p[0] == 'f' && obj_space(p[1])) {
+            p += 2;
+            face.clear();
+            bool ok = true;
+            while (true) {
+                skip_space(p, end);
+                if (p == end || *p == '\n' || *p == '#')
+                    break;
+                corner c = {0, no_normal, false, false};
+                int64_t index;
+                ok = parse_index(p, end, index);
+                if (!ok)
+                    break;
+                c.relative_v = index < 0;
+                c.v = index < 0 ? int64_t(chunk.positions.size() / 3) + index : index - 1;
+                if (p < end && *p == '/') {
+                    ++p;
+                    if (p < end && *p != '/' && !obj_space(*p) && *p != '\n')
+                        ok = parse_index(p, end, index);     // texture coordinates are not used
+                    if (ok && p < end && *p == '/') {
+                        ++p;
+                        ok = parse_index(p, end, index);
+                        c.relative_n = index < 0;
+                        c.n = index < 0 ? int64_t(chunk.normals.size() / 3) + index : index - 1;
+                    }
+                }
+                if (!ok || (p < end && !obj_space(*p) && *p != '\n')) {
+                    ok = false;
+                    break;
+                }
+                face.push_back(c);
+            }
+
+            if (!ok || face.size() < 3) {
+                ++chunk.bad_lines;
+            } else {
+                for (size_t k = 1; k + 1 < face.size(); ++k) {
+                    const corner* triangle[3] = {&face[0], &face[k], &face[k+1]};
+                    for (auto c : triangle) {
+                        if (c->relative_v)
+                            chunk.relative_vertices.push_back(chunk.corner_vertices.size());
+                        if (c->relative_n)
+                            chunk.relative_normals.push_back(chunk.corner_normals.size());
+                        chunk.corner_vertices.push_back(c->v);
+                        chunk.corner_normals.push_back(c->n);
+                    }
+                }
+            }
+        }
+        skip_line(p, end);
+    }
+}
+
+// Open addressing hash table of element ids used to merge equal elements.
+const uint32_t empty_slot = UINT32_MAX;
+
+// Smallest power of two that keeps a table of `count` elements at most half
+// full.
+inline size_t hash_table_size(size_t count) {
+    size_t size = 16;
+    while (size < 2 * count)
+        size *= 2;
+    return size;
+}
+
+// Returns the id of an element already in table that equals element id, or
+// inserts id and returns it. equal(a, b) compares elements a and b.
+template <typename equal_function>
+uint32_t deduplicate(std::vector<uint32_t>& table, uint64_t hash, uint32_t id, const equal_function& equal) {
+    size_t mask = table.size() - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        if (table[slot] == empty_slot) {
+            table[slot] = id;
+            return id;
+        }
+        if (equal(table[slot], id))
+            return table[slot];
+    }
+}
+
+// Doubles the size of a table whose elements are identified by their keys.
+inline void rehash(std::vector<uint32_t>& table, const std::vector<uint64_t>& keys) {
+    table.assign(table.size() * 2, empty_slot);
+    size_t mask = table.size() - 1;
+    for (uint32_t id = 0; id < keys.size(); ++id) {
+        size_t slot = sample_rng::mix(keys[id]) & mask;
+        while (table[slot] != empty_slot)
+            slot = (slot + 1) & mask;
+        table[slot] = id;
+    }
+}
+
+// Files are split into chunks of at least this many bytes for parsing in
+// parallel.
+const size_t min_obj_chunk_bytes = 256 * 1024;
+
+// Loads the OBJ file at path ("-" for stdin) into indexed geometry, merging
+// corners that share a position and normal into one vertex. Exporters often
+// write one normal per face corner even where they are equal, so normals are
+// matched by value, not index. Large files are parsed in parallel on up to
+// `threads` workers.
+bool load_obj(const std::string& path, mesh_data& data, int threads = 0) {
+    auto started = std::chrono::steady_clock::now();
+    file_view file;
+    if (!file.open(path))
+        return false;
+    const char* text = file.data();
+    size_t size = file.size();
+
+    // Chunk boundaries are moved forward to the start of the next line.
+    size_t chunk_count = std::max<size_t>(1, std::min<size_t>(4 * worker_count(threads), size / min_obj_chunk_bytes));
+    std::vector<size_t> bounds(chunk_count + 1, size);
+    bounds[0] = 0;
+    for (size_t c = 1; c < chunk_count; ++c) {
+        const char* p = text + std::max(bounds[c-1], c * (size / chunk_count));
+        skip_line(p, text + size);
+        bounds[c] = p - text;
+    }
+
+    std::vector<obj_chunk> chunks(chunk_count);
+    parallel_for(chunk_count, threads, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c)
+            parse_obj_chunk(text + bounds[c], text + bounds[c+1], chunks[c]);
+    });
+
+    // Join the chunks and resolve the relative indices.
+    std::vector<double> positions, normals;
+    std::vector<int64_t> corner_vertices, corner_normals;
+    size_t bad_lines = 0;
+    for (auto& chunk : chunks) {
+        int64_t first_vertex = positions.size() / 3;
+        int64_t first_normal = normals.size() / 3;
+        for (auto k : chunk.relative_vertices)
+            chunk.corner_vertices[k] += first_vertex;
+        for (auto k : chunk.relative_normals)
+            chunk.corner_normals[k] += first_normal;
+        positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+        normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        corner_vertices.insert(corner_vertices.end(), chunk.corner_vertices.begin(), chunk.corner_vertices.end());
+        corner_normals.insert(corner_normals.end(), chunk.corner_normals.begin(), chunk.corner_normals.end());
+        bad_lines += chunk.bad_lines;
+    }
+    chunks.clear();
+
+    int64_t vertex_count = positions.size() / 3;
+    int64_t normal_count = normals.size() / 3;
+    bool has_normals = normal_count > 0;
+    for (size_t k = 0; k < corner_vertices.size(); ++k) {
+        bool has_normal = corner_normals[k] != no_normal;
+        if (corner_vertices[k] < 0 || corner_vertices[k] >= vertex_count
+            || (has_normal && (corner_normals[k] < 0 || corner_normals[k] >= normal_count))) {
+            std::cerr << path << ": face refers to a vertex or normal that does not exist.\n";
+            return false;
+        }
+        has_normals = has_normals && has_normal;
+    }
+    if (bad_lines > 0)
+        std::cerr << path << ": skipped " << bad_lines << " malformed lines.\n";
+
+    // Adding 0.0 turns -0.0 into 0.0, so normals that compare equal hash
+    // the same.
+    auto normal_hash = [&](uint32_t n) {
+        uint64_t hash = 0;
+        for (int a = 0; a < 3; ++a) {
+            double x = normals[3*size_t(n) + a] + 0.0;
+            uint64_t bits;
+            std::memcpy(&bits, &x, sizeof(bits));
+            hash = sample_rng::mix(hash ^ bits);
+        }
+        return hash;
+    };
+    std::vector<uint32_t> same_normal(normal_count);
+    if (has_normals) {
+        std::vector<uint32_t> table(hash_table_size(normal_count), empty_slot);
+        for (uint32_t n = 0; n < normal_count; ++n) {
+            same_normal[n] = deduplicate(table, normal_hash(n), n, [&](uint32_t a, uint32_t b) {
+                return std::equal(&normals[3*size_t(a)], &normals[3*size_t(a)] + 3, &normals[3*size_t(b)]);
+            });
+        }
+    }
+
+    std::vector<float> vertex_positions, vertex_normals;
+    std::vector<uint32_t> indices(corner_vertices.size());
+    std::vector<uint64_t> vertex_keys;
+    std::vector<uint32_t> table(hash_table_size(std::min<size_t>(corner_vertices.size(), 2 * vertex_count)), empty_slot);
+    for (size_t k = 0; k < corner_vertices.size(); ++k) {
+        auto v = static_cast<uint32_t>(corner_vertices[k]);
+        uint32_t n = has_normals ? same_normal[corner_normals[k]] : 0;
+        uint64_t key = (uint64_t(v) << 32) | n;
+
+        auto next_id = static_cast<uint32_t>(vertex_keys.size());
+        uint32_t id = deduplicate(table, sample_rng::mix(key), next_id, [&](uint32_t a, uint32_t) {
+            return vertex_keys[a] == key;
+        });
+        if (id == next_id) {
+            vertex_keys.push_back(key);
+            if (vertex_keys.size() > table.size() / 2)
+                rehash(table, vertex_keys);
+            for (int a = 0; a < 3; ++a)
+                vertex_positions.push_back(static_cast<float>(positions[3*size_t(v) + a]));
+            if (has_normals) {
+                auto unit = unit_vector(basic_vec3<double>(normals[3*size_t(n)], normals[3*size_t(n) + 1], normals[3*size_t(n) + 2]));
+                for (int a = 0; a < 3; ++a)
+                    vertex_normals.push_back(static_cast<float>(unit[a]));
+            }
+        }
+        indices[k] = id;
+    }
+    data.positions = array_view<float>(std::move(vertex_positions));
+    data.normals = array_view<float>(std::move(vertex_normals));
+    data.indices = array_view<uint32_t>(std::move(indices));
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+    // One write, so that lines from meshes loaded in parallel don't mix.
+    std::ostringstream report;
+    report << "OBJ " << path << ": " << size / (1024.0 * 1024.0) << " MB, "
+           << data.triangle_count() << " triangles in " << elapsed.count() << " ms ("
+           << size / (1024.0 * 1024.0) / (elapsed.count() / 1000.0) << " MB/s)\n";
+    std::cerr << report.str();
+    return true;
+}
+
+#endif
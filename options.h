@@ -0,0 +1,163 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct render_options {
+    int threads = 0;        // 0 means one worker per hardware thread
+    int tile_size = 16;     // width and height of a tile in pixels
+    int samples = 0;        // samples per pixel, 0 keeps the scene default
+    std::string output_path;    // empty writes to stdout
+    std::string format;         // p3, ppm, pfm or exr; empty picks from output_path
+    std::vector<std::string> meshes;    // FILE[:MATERIAL[:X,Y,Z[:DEGREES]]], empty reads stdin
+    bool mesh_cache = true;             // cache compiled meshes and their BVHs next to the OBJ files
+    bool compile = false;               // only compile the meshes, don't render
+
+    // acceleration structure
+    std::string bvh = "sah";            // median or sah
+    std::string bvh_layout = "wide4";   // tree, flat, wide4 or wide8
+    int leaf_size = 4;
+    std::string triangle = "watertight";    // watertight, packet or barycentric
+
+    // progressive rendering
+    bool progressive = false;
+    int pass_samples = 16;
+    double checkpoint_interval = 600;
+    std::string checkpoint_path;
+    std::string resume_path;
+
+    // adaptive sampling
+    double adaptive_threshold = 0;  // 0 disables adaptive sampling
+    int min_samples = 32;
+    int max_samples = 0;            // 0 means four times --samples
+    std::string sample_map_path;
+
+    int bench_rays = 0;             // trace this many rays, report throughput and exit
+    std::string compare_path;       // PFM image to compare the render with
+    int check_bvh_rays = 0;         // compare the wide and flat BVH layouts with this many rays and exit
+    bool self_test = false;         // run the built-in tests and exit
+};
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] [--mesh mesh.obj | < mesh.obj] [> image.ppm]\n"
+              << "  -t, --threads N     number of render and BVH build threads (default: all cores)\n"
+              << "      --tile-size N   tile width/height in pixels (default: 16)\n"
+              << "  -s, --samples N     samples per pixel\n"
+              << "  -o, --output FILE   write the image to FILE instead of stdout\n"
+              << "  -f, --format F      p3 (ASCII PPM), ppm (binary), pfm (float) or exr (float, RLE)\n"
+              << "                      (default: from the output extension, ppm for stdout)\n"
+              << "  -m, --mesh FILE[:MATERIAL[:X,Y,Z[:DEGREES]]]\n"
+              << "                      load the OBJ file FILE instead of reading stdin, optionally with its own\n"
+              << "                      material (white, red, green, metal, mirror, glass or light), position\n"
+              << "                      and rotation about y; repeat to load several meshes in parallel\n"
+              << "      --compile       compile every --mesh OBJ file into FILE.rtmesh and exit\n"
+              << "      --no-mesh-cache don't load or write the FILE.rtmesh and FILE.rtbvh caches of OBJ files\n"
+              << "      --bvh B         BVH builder: sah (binned SAH) or median (default: sah)\n"
+              << "      --bvh-layout L  flat (contiguous node array), tree (linked nodes), wide4 or wide8\n"
+              << "                      (4 or 8 children per node, SIMD box tests) (default: wide4)\n"
+              << "      --leaf-size N   most primitives per SAH leaf (default: 4)\n"
+              << "      --triangle T    triangle test: watertight, packet (SIMD, meshes only) or barycentric\n"
+              << "                      (default: watertight)\n"
+              << "  -p, --progressive   render in passes that add --pass-samples samples each\n"
+              << "      --pass-samples N           samples added per progressive pass (default: 16)\n"
+              << "      --checkpoint FILE          write checkpoints to FILE (implies --progressive)\n"
+              << "      --checkpoint-interval SEC  seconds between checkpoints (default: 600)\n"
+              << "      --resume FILE              continue from checkpoint FILE up to --samples\n"
+              << "      --adaptive ERROR           stop sampling pixels once their relative error is below ERROR\n"
+              << "      --min-samples N            samples per pixel before a pixel may converge (default: 32)\n"
+              << "      --max-samples N            upper limit of samples per pixel (default: 4x --samples)\n"
+              << "      --sample-map FILE          write the number of samples per pixel as a PGM image\n"
+              << "      --bench N                  measure BVH traversal speed with N rays instead of rendering\n"
+              << "      --check-bvh N              check that the wide and flat BVH layouts agree on N rays\n"
+              << "      --self-test                run the built-in tests and exit\n"
+              << "      --compare FILE             print the difference between the render and the PFM image FILE\n"
+              << "  -h, --help          show this message\n";
+}
+
+// Parses the command line into opts. Returns false if the program should exit.
+bool parse_options(int argc, char* argv[], render_options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if ((arg == "-t" || arg == "--threads") && has_value) {
+            opts.threads = std::atoi(argv[++i]);
+        } else if (arg == "--tile-size" && has_value) {
+            opts.tile_size = std::atoi(argv[++i]);
+        } else if ((arg == "-s" || arg == "--samples") && has_value) {
+            opts.samples = std::atoi(argv[++i]);
+        } else if ((arg == "-o" || arg == "--output") && has_value) {
+            opts.output_path = argv[++i];
+        } else if ((arg == "-f" || arg == "--format") && has_value) {
+            opts.format = argv[++i];
+        } else if ((arg == "-m" || arg == "--mesh") && has_value) {
+            opts.meshes.push_back(argv[++i]);
+        } else if (arg == "--compile") {
+            opts.compile = true;
+        } else if (arg == "--no-mesh-cache") {
+            opts.mesh_cache = false;
+        } else if (arg == "--bvh" && has_value) {
+            opts.bvh = argv[++i];
+        } else if (arg == "--bvh-layout" && has_value) {
+            opts.bvh_layout = argv[++i];
+        } else if (arg == "--leaf-size" && has_value) {
+            opts.leaf_size = std::atoi(argv[++i]);
+        } else if (arg == "--triangle" && has_value) {
+            opts.triangle = argv[++i];
+        } else if (arg == "-p" || arg == "--progressive") {
+            opts.progressive = true;
+        } else if (arg == "--pass-samples" && has_value) {
+            opts.pass_samples = std::atoi(argv[++i]);
+        } else if (arg == "--checkpoint" && has_value) {
+            opts.checkpoint_path = argv[++i];
+            opts.progressive = true;
+        } else if (arg == "--checkpoint-interval" && has_value) {
+            opts.checkpoint_interval = std::atof(argv[++i]);
+        } else if (arg == "--resume" && has_value) {
+            opts.resume_path = argv[++i];
+            opts.progressive = true;
+        } else if (arg == "--adaptive" && has_value) {
+            opts.adaptive_threshold = std::atof(argv[++i]);
+            opts.progressive = true;
+        } else if (arg == "--min-samples" && has_value) {
+            opts.min_samples = std::atoi(argv[++i]);
+        } else if (arg == "--max-samples" && has_value) {
+            opts.max_samples = std::atoi(argv[++i]);
+        } else if (arg == "--sample-map" && has_value) {
+            opts.sample_map_path = argv[++i];
+        } else if (arg == "--bench" && has_value) {
+            opts.bench_rays = std::atoi(argv[++i]);
+        } else if (arg == "--check-bvh" && has_value) {
+            opts.check_bvh_rays = std::atoi(argv[++i]);
+        } else if (arg == "--self-test") {
+            opts.self_test = true;
+        } else if (arg == "--compare" && has_value) {
+            opts.compare_path = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return false;
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << "\n";
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (opts.threads < 0 || opts.tile_size <= 0 || opts.samples < 0 || opts.pass_samples <= 0 || opts.leaf_size <= 0
+        || opts.adaptive_threshold < 0 || opts.min_samples < 0 || opts.max_samples < 0 || opts.bench_rays < 0
+        || opts.check_bvh_rays < 0) {
+        std::cerr << "Counts and thresholds must be >= 0, tile size, pass samples and leaf size must be > 0.\n";
+        return false;
+    }
+
+    // Resuming keeps checkpointing to the same file unless told otherwise.
+    if (!opts.resume_path.empty() && opts.checkpoint_path.empty())
+        opts.checkpoint_path = opts.resume_path;
+
+    return true;
+}
+
+#endif
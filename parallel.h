@@ -0,0 +1,41 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Number of workers to use when `requested` were asked for; 0 means one per
+// hardware thread.
+int worker_count(int requested) {
+    if (requested > 0)
+        return requested;
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    return cores > 0 ? cores : 1;
+}
+
+// Splits [0, count) into contiguous chunks of at least min_chunk items and
+// calls body(begin, end) on each from up to `threads` workers, the calling
+// thread included.
+template <typename chunk_function>
+void parallel_for(size_t count, int threads, size_t min_chunk, const chunk_function& body) {
+    size_t chunks = std::min<size_t>(worker_count(threads), (count + min_chunk - 1) / std::max<size_t>(min_chunk, 1));
+    if (chunks <= 1) {
+        if (count > 0)
+            body(size_t(0), count);
+        return;
+    }
+
+    size_t per_chunk = (count + chunks - 1) / chunks;
+    std::vector<std::thread> pool;
+    for (size_t begin = per_chunk; begin < count; begin += per_chunk) {
+        size_t end = std::min(count, begin + per_chunk);
+        pool.emplace_back([&body, begin, end]() { body(begin, end); });
+    }
+    body(size_t(0), per_chunk);
+    for (auto& thread : pool)
+        thread.join();
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include <limits>
+
+// Scalar type of the geometry core: points, directions, rays, boxes and hit
+// distances. Build with -DRT_SINGLE_PRECISION to trace in float; colors and
+// the accumulated image stay in double either way.
+#ifdef RT_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
+// Tolerances that depend on the precision of the scalar type.
+template <typename scalar>
+struct scalar_traits;
+
+template <>
+struct scalar_traits<double> {
+    // Shortest distance at which a ray may hit something, so that it does
+    // not hit the surface it leaves from again.
+    static double ray_epsilon() { return 0.001; }
+
+    // Relative rounding error of a hit point, times its magnitude; added to
+    // ray_epsilon() for rays that start far from the origin.
+    static double relative_epsilon() { return 64 * std::numeric_limits<double>::epsilon(); }
+
+    // Length below which a vector counts as zero.
+    static double near_zero() { return 1e-8; }
+
+    // Half the thickness given to the bounding boxes of flat primitives.
+    static double box_padding() { return 0.0001; }
+};
+
+template <>
+struct scalar_traits<float> {
+    static float ray_epsilon() { return 0.001f; }
+    static float relative_epsilon() { return 64 * std::numeric_limits<float>::epsilon(); }
+    static float near_zero() { return 1e-6f; }
+    static float box_padding() { return 0.001f; }
+};
+
+#endif
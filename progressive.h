@@ -0,0 +1,252 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "framebuffer.h"
+#include "render.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Checkpoint files
+
+// Layout (native endianness):
+//   char     magic[8]            "RTCHKPT\0"
+//   uint32_t version, width, height, reserved
+//   uint64_t scene               see progressive_settings::scene_id
+//   double   sums[width*height*3]
+//   double   luminance_sq[width*height]
+//   uint32_t samples[width*height]
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t scene;
+};
+
+const char checkpoint_magic[8] = {'R','T','C','H','K','P','T','\0'};
+const uint32_t checkpoint_version = 3;
+
+// Writes fb to path atomically: the data goes to a temporary file which is
+// synced and then renamed over path, so a crash mid-write never leaves a
+// truncated checkpoint behind.
+bool save_checkpoint(const framebuffer& fb, const std::string& path, uint64_t scene_id) {
+    std::string tmp_path = path + ".tmp";
+    FILE* file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "\nCould not open " << tmp_path << " for writing.\n";
+        return false;
+    }
+
+    checkpoint_header header;
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.width = fb.width;
+    header.height = fb.height;
+    header.reserved = 0;
+    header.scene = scene_id;
+
+    std::vector<double> sums(fb.pixels.size() * 3);
+    for (size_t p = 0; p < fb.pixels.size(); ++p)
+        for (int c = 0; c < 3; ++c)
+            sums[p*3 + c] = fb.pixels[p][c];
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+           && std::fwrite(sums.data(), sizeof(double), sums.size(), file) == sums.size()
+           && std::fwrite(fb.luminance_sq.data(), sizeof(double), fb.luminance_sq.size(), file) == fb.luminance_sq.size()
+           && std::fwrite(fb.samples.data(), sizeof(uint32_t), fb.samples.size(), file) == fb.samples.size()
+           && std::fflush(file) == 0
+           && fsync(fileno(file)) == 0;
+    ok = (std::fclose(file) == 0) && ok;
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "\nFailed to write checkpoint " << path << ".\n";
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Reads the samples of the checkpoint at path into fb. Fails unless it was
+// written for an image of the same size and the same scene_id.
+bool load_checkpoint(framebuffer& fb, const std::string& path, uint64_t scene_id) {
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Could not open checkpoint " << path << ".\n";
+        return false;
+    }
+
+    checkpoint_header header;
+    bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+           && std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) == 0
+           && header.version == checkpoint_version;
+    if (!ok) {
+        std::cerr << path << " is not a checkpoint file.\n";
+        std::fclose(file);
+        return false;
+    }
+    if (header.width != static_cast<uint32_t>(fb.width) || header.height != static_cast<uint32_t>(fb.height)) {
+        std::cerr << "Checkpoint is " << header.width << "x" << header.height
+                  << " but the image is " << fb.width << "x" << fb.height << ".\n";
+        std::fclose(file);
+        return false;
+    }
+    if (header.scene != scene_id) {
+        std::cerr << "Checkpoint " << path << " was rendered with another scene, camera, mesh geometry or render options;"
+                  << " its samples can't be added to this render.\n";
+        std::fclose(file);
+        return false;
+    }
+
+    std::vector<double> sums(fb.pixels.size() * 3);
+    ok = std::fread(sums.data(), sizeof(double), sums.size(), file) == sums.size()
+      && std::fread(fb.luminance_sq.data(), sizeof(double), fb.luminance_sq.size(), file) == fb.luminance_sq.size()
+      && std::fread(fb.samples.data(), sizeof(uint32_t), fb.samples.size(), file) == fb.samples.size();
+    std::fclose(file);
+    if (!ok) {
+        std::cerr << "Checkpoint " << path << " is truncated.\n";
+        return false;
+    }
+
+    for (size_t p = 0; p < fb.pixels.size(); ++p)
+        fb.pixels[p] = color(sums[p*3], sums[p*3 + 1], sums[p*3 + 2]);
+    return true;
+}
+
+// Signals
+
+// SIGUSR1 asks for a checkpoint and rendering continues afterwards; SIGINT
+// writes a checkpoint and stops. A second SIGINT kills the process as usual.
+volatile std::sig_atomic_t pending_signal = 0;
+
+extern "C" void handle_checkpoint_signal(int sig) {
+    pending_signal = sig;
+    if (sig == SIGINT)
+        std::signal(SIGINT, SIG_DFL);
+}
+
+void install_checkpoint_handlers() {
+    std::signal(SIGINT, handle_checkpoint_signal);
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, handle_checkpoint_signal);
+#endif
+}
+
+// Progressive rendering
+
+struct progressive_settings {
+    int threads;
+    int tile_size;
+    uint32_t samples_per_pixel;     // total samples per pixel to reach
+    uint32_t pass_samples;          // samples added to every pixel per pass
+    double checkpoint_interval;     // seconds between checkpoints, 0 disables
+    std::string checkpoint_path;
+    uint64_t scene_id;              // hash of everything the samples depend on, kept in checkpoints
+
+    // Adaptive sampling. A pixel stops being sampled once it has min_samples
+    // and its relative error is below adaptive_threshold. The samples saved
+    // go to the remaining pixels, up to max_samples each, until the budget of
+    // samples_per_pixel times the pixel count is spent.
+    double adaptive_threshold;      // 0 disables adaptive sampling
+    uint32_t min_samples;
+    uint32_t max_samples;
+};
+
+// Marks pixels whose estimate is accurate enough as converged. The decision
+// only depends on the accumulated samples, so it is the same after a resume.
+void update_convergence(framebuffer& fb, const progressive_settings& settings) {
+    if (settings.adaptive_threshold <= 0)
+        return;
+
+    for (size_t p = 0; p < fb.samples.size(); ++p) {
+        if (!fb.converged[p] && fb.samples[p] >= settings.min_samples
+            && fb.relative_error(p) < settings.adaptive_threshold)
+            fb.converged[p] = 1;
+    }
+}
+
+// Renders in passes of pass_samples until every pixel has samples_per_pixel
+// samples, or with adaptive sampling until every pixel has converged or the
+// sample budget is spent. fb may already contain samples from a checkpoint,
+// in which case those are kept and only the missing samples are rendered.
+// Returns false if the render was stopped by SIGINT.
+template <typename sample_function>
+bool render_progressive(framebuffer& fb, const progressive_settings& settings, const sample_function& trace_sample) {
+    using clock = std::chrono::steady_clock;
+    auto last_checkpoint = clock::now();
+
+    bool adaptive = settings.adaptive_threshold > 0;
+    uint32_t max_samples = adaptive ? settings.max_samples : settings.samples_per_pixel;
+    uint64_t budget = uint64_t(settings.samples_per_pixel) * fb.samples.size();
+
+    auto checkpoint_due = [&]() {
+        if (pending_signal != 0)
+            return true;
+        // Without a file to write to, the interval never comes due.
+        if (settings.checkpoint_interval <= 0 || settings.checkpoint_path.empty())
+            return false;
+        std::chrono::duration<double> elapsed = clock::now() - last_checkpoint;
+        return elapsed.count() >= settings.checkpoint_interval;
+    };
+
+    auto write_checkpoint = [&]() {
+        if (!settings.checkpoint_path.empty() && save_checkpoint(fb, settings.checkpoint_path, settings.scene_id))
+            std::cerr << "\nCheckpoint written to " << settings.checkpoint_path
+                      << " (" << fb.min_samples() << " samples per pixel)\n";
+        last_checkpoint = clock::now();
+    };
+
+    install_checkpoint_handlers();
+
+    while (true) {
+        update_convergence(fb, settings);
+
+        uint32_t level = fb.min_active_samples();
+        if (level >= max_samples)
+            break;
+
+        uint32_t target = std::min(max_samples, level + settings.pass_samples);
+        if (adaptive) {
+            uint64_t spent = fb.total_samples();
+            if (spent >= budget)
+                break;
+
+            // Don't let the last pass overshoot the budget by much.
+            uint64_t active = std::count(fb.converged.begin(), fb.converged.end(), 0);
+            uint64_t affordable = std::max<uint64_t>(1, (budget - spent) / active);
+            if (level >= settings.min_samples)
+                target = static_cast<uint32_t>(std::min<uint64_t>(target, level + affordable));
+        }
+        std::cerr << "\rPass up to " << target << " of " << max_samples << " samples\n";
+
+        bool finished = render_tiles(fb, settings.threads, settings.tile_size, target, trace_sample, checkpoint_due);
+
+        if (finished && !checkpoint_due())
+            continue;
+
+        write_checkpoint();
+        if (pending_signal == SIGINT)
+            return false;
+        pending_signal = 0;
+    }
+
+    if (adaptive) {
+        auto converged = std::count(fb.converged.begin(), fb.converged.end(), 1);
+        std::cerr << "\rAdaptive sampling: " << converged << " of " << fb.samples.size()
+                  << " pixels converged, " << double(fb.total_samples()) / fb.samples.size()
+                  << " samples per pixel on average\n";
+    }
+
+    write_checkpoint();
+    return true;
+}
+
+#endif
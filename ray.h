@@ -3,23 +3,70 @@
 
 #include "vec3.h"
 
-class ray {
+// Ray with scalar type T; the renderer uses ray, basic_ray<real>.
+template <typename T>
+class basic_ray {
     public:
-        point3 orig;
-        vec3 dir;
-        double tm;
-        ray() {}
-         ray(const point3& origin, const vec3& direction, double time = 0.0)
-            : orig(origin), dir(direction), tm(time)
-        {}
-
-        point3 origin() const { return orig; }
-        vec3 direction() const { return dir; }
-         double time() const    { return tm; }
-
-        point3 at(double t) const {
+        typedef basic_vec3<T> vector_type;
+
+        vector_type orig;
+        vector_type dir;
+        T tm;
+        vector_type inv_dir;   // 1 / dir per component, for box tests
+        int sign[3];    // 1 where inv_dir is negative
+
+        // For the watertight triangle test: the axes permuted so that
+        // axis[2] is the largest direction component, and the shear that
+        // maps the direction onto that axis.
+        int axis[3];
+        vector_type shear;
+
+        basic_ray() {}
+         basic_ray(const vector_type& origin, const vector_type& direction, T time = 0)
+            : orig(origin), dir(direction), tm(time),
+              inv_dir(1 / direction.x(), 1 / direction.y(), 1 / direction.z())
+        {
+            for (int a = 0; a < 3; a++)
+                sign[a] = inv_dir[a] < 0;
+
+            auto x = fabs(dir.x()), y = fabs(dir.y()), z = fabs(dir.z());
+            int kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+            int kx = (kz + 1) % 3;
+            int ky = (kx + 1) % 3;
+            // Keep the winding of triangles when looking down -z.
+            if (dir[kz] < 0) {
+                int k = kx; kx = ky; ky = k;
+            }
+            axis[0] = kx; axis[1] = ky; axis[2] = kz;
+            shear = vector_type(dir[kx] * inv_dir[kz], dir[ky] * inv_dir[kz], inv_dir[kz]);
+        }
+
+        vector_type origin() const { return orig; }
+        vector_type direction() const { return dir; }
+         T time() const    { return tm; }
+
+        vector_type at(T t) const {
             return orig + t*dir;
         }
+
+        // The same ray from another origin, without recomputing inv_dir.
+        basic_ray moved_to(const vector_type& origin) const {
+            basic_ray moved = *this;
+            moved.orig = origin;
+            return moved;
+        }
 };
 
+typedef basic_ray<real> ray;
+
+// Shortest distance at which r may hit something without it being the
+// surface r starts on. Rounding errors in the hit point grow with its
+// distance from the world origin, which matters in single precision.
+template <typename T>
+T min_hit_distance(const basic_ray<T>& r) {
+    T scale = fmax(fabs(r.orig[0]), fmax(fabs(r.orig[1]), fabs(r.orig[2])));
+    T length = fmax(fabs(r.dir[0]), fmax(fabs(r.dir[1]), fabs(r.dir[2])));
+    return fmax(scalar_traits<T>::ray_epsilon(), scalar_traits<T>::relative_epsilon() * scale / length);
+}
+
 #endif
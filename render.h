@@ -0,0 +1,129 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "framebuffer.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct tile {
+    int x0, y0;     // top left pixel, inclusive
+    int x1, y1;     // bottom right pixel, exclusive
+};
+
+std::vector<tile> make_tiles(int width, int height, int tile_size) {
+    std::vector<tile> tiles;
+    for (int y = 0; y < height; y += tile_size)
+        for (int x = 0; x < width; x += tile_size)
+            tiles.push_back({x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+    return tiles;
+}
+
+// Work-stealing tile queue. Every worker starts with a contiguous run of
+// tiles (so neighbouring tiles share cache-warm geometry) and pops from the
+// back of its own deque. A worker that runs dry steals from the front of the
+// other deques, which takes the tiles their owners would reach last.
+class tile_scheduler {
+    public:
+        tile_scheduler(const std::vector<tile>& tiles, int workers) : queues(workers) {
+            size_t per_worker = (tiles.size() + workers - 1) / workers;
+            for (size_t t = 0; t < tiles.size(); ++t)
+                queues[t / per_worker].tiles.push_front(tiles[t]);
+        }
+
+        bool next(int worker, tile& out) {
+            if (pop_back(queues[worker], out))
+                return true;
+
+            int n = static_cast<int>(queues.size());
+            for (int k = 1; k < n; ++k) {
+                if (steal_front(queues[(worker + k) % n], out))
+                    return true;
+            }
+            return false;
+        }
+
+    private:
+        struct work_queue {
+            std::mutex lock;
+            std::deque<tile> tiles;
+        };
+
+        static bool pop_back(work_queue& q, tile& out) {
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tiles.empty()) return false;
+            out = q.tiles.back();
+            q.tiles.pop_back();
+            return true;
+        }
+
+        static bool steal_front(work_queue& q, tile& out) {
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tiles.empty()) return false;
+            out = q.tiles.front();
+            q.tiles.pop_front();
+            return true;
+        }
+
+        std::vector<work_queue> queues;
+};
+
+// Brings every pixel of fb that has not converged up to target_samples
+// samples. trace_sample(i, j, s) returns sample number s of pixel (i, j).
+// Tiles are spread over `threads` workers; the calling thread is one of them.
+//
+// interrupted() is polled after each finished tile. Once it returns true the
+// workers finish the tiles they hold and stop, leaving fb consistent. Returns
+// true if every pixel reached target_samples.
+template <typename sample_function>
+bool render_tiles(
+    framebuffer& fb, int threads, int tile_size, uint32_t target_samples,
+    const sample_function& trace_sample,
+    const std::function<bool()>& interrupted = nullptr
+) {
+    auto tiles = make_tiles(fb.width, fb.height, tile_size);
+    int workers = std::max(1, std::min(worker_count(threads), static_cast<int>(tiles.size())));
+    tile_scheduler scheduler(tiles, workers);
+
+    std::atomic<int> tiles_remaining(static_cast<int>(tiles.size()));
+    std::atomic<bool> stopped(false);
+    std::mutex progress_lock;
+
+    auto work = [&](int worker) {
+        tile t;
+        while (!stopped && scheduler.next(worker, t)) {
+            for (int j = t.y0; j < t.y1; ++j) {
+                for (int i = t.x0; i < t.x1; ++i) {
+                    if (fb.converged[j * fb.width + i])
+                        continue;
+                    for (uint32_t s = fb.sample_count(i, j); s < target_samples; ++s)
+                        fb.add_sample(i, j, trace_sample(i, j, s));
+                }
+            }
+
+            int remaining = --tiles_remaining;
+            std::lock_guard<std::mutex> guard(progress_lock);
+            std::cerr << "\rTiles remaining: " << remaining << "   " << std::flush;
+            if (interrupted && interrupted())
+                stopped = true;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int w = 1; w < workers; ++w)
+        pool.emplace_back(work, w);
+    work(0);
+    for (auto& thread : pool)
+        thread.join();
+
+    return tiles_remaining == 0;
+}
+
+#endif
@@ -7,20 +7,43 @@
 class sphere : public hittable {
     public:
         sphere() {}
-        sphere(point3 cen, double r, shared_ptr<material> m) : center(cen), radius(r), material_pointer(m) {};
+        sphere(point3 cen, real r, shared_ptr<material> m) : center(cen), radius(r), material_pointer(m) {};
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& rec) const override;
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual void surface(const ray& r, hit_data& rec) const override;
+
+        // Only rotations, reflections and uniform scales keep a sphere a sphere.
+        virtual bool apply_transform(const mat34& t) override {
+            double scale;
+            if (!t.is_similarity(scale))
+                return false;
+            center = t.point(center);
+            radius *= scale;
+            return true;
+        }
+
+        // The extent of a transformed sphere along an axis is the radius
+        // times the length of that row of the linear part.
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            point3 moved = t.point(center);
+            vec3 extent;
+            for (int a = 0; a < 3; ++a)
+                extent[a] = radius * sqrt(t.m[a][0]*t.m[a][0] + t.m[a][1]*t.m[a][1] + t.m[a][2]*t.m[a][2]);
+            output_box = aabb(moved - extent, moved + extent);
+            return true;
+        }
+
     public:
         point3 center;
-        double radius;
+        real radius;
         shared_ptr<material> material_pointer;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_data& data) const {
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_data& data) const {
     vec3 originToCenter = r.origin() - center;
     auto a = dot(r.direction(), r.direction());
     auto b = 2.0 * dot(originToCenter, r.direction());
@@ -39,13 +62,15 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_data& data) const
             return false;
     }
 
-    data.t = root;
+    data.set_hit(root, this);
+    return true;
+}
+
+void sphere::surface(const ray& r, hit_data& data) const {
     data.hit_point = r.at(data.t);
     vec3 outward_normal = (data.hit_point - center) / radius;
     data.set_face_normal(r, outward_normal);
-    data.material_pointer = material_pointer;
-
-    return true;
+    data.material_pointer = material_pointer.get();
 }
 
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
@@ -0,0 +1,151 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "utility.h"
+
+#include "aabb.h"
+#include "ray.h"
+#include "vec3.h"
+
+// Affine transform as a 3x4 matrix: m[row][0..2] is the linear part and
+// m[row][3] the translation. Kept in double whatever real is, so that chains
+// of transforms and their inverses don't lose precision.
+struct mat34 {
+    double m[3][4];
+
+    static mat34 identity() {
+        return scaling(vec3(1, 1, 1));
+    }
+
+    static mat34 translation(const vec3& offset) {
+        mat34 t = identity();
+        for (int r = 0; r < 3; ++r)
+            t.m[r][3] = offset[r];
+        return t;
+    }
+
+    // Rotation about the y axis, the same as rotate_y.
+    static mat34 rotation_y(double degrees) {
+        auto radians = degrees_to_radians(degrees);
+        double s = sin(radians), c = cos(radians);
+        mat34 t = identity();
+        t.m[0][0] = c;  t.m[0][2] = s;
+        t.m[2][0] = -s; t.m[2][2] = c;
+        return t;
+    }
+
+    static mat34 scaling(const vec3& factors) {
+        mat34 t;
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 4; ++c)
+                t.m[r][c] = r == c ? double(factors[r]) : 0.0;
+        return t;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                      m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                      m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                    m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                    m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+    }
+
+    // Applies the transpose of the linear part. Normals are transformed by
+    // the inverse transpose, so the inverse transform does that with this.
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                    m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                    m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+    }
+
+    // True if the linear part is a rotation or reflection times a uniform
+    // scale, which it stores in scale, so that spheres stay spheres.
+    bool is_similarity(double& scale) const {
+        double column[3][3];
+        for (int c = 0; c < 3; ++c)
+            for (int r = 0; r < 3; ++r)
+                column[c][r] = m[r][c];
+        auto dot3 = [](const double* a, const double* b) { return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; };
+        double square = dot3(column[0], column[0]);
+        const double tolerance = 1e-9 * square;
+        for (int c = 0; c < 3; ++c) {
+            if (fabs(dot3(column[c], column[c]) - square) > tolerance
+                || fabs(dot3(column[c], column[(c + 1) % 3])) > tolerance)
+                return false;
+        }
+        scale = sqrt(square);
+        return scale > 0;
+    }
+
+    // Determinant of the linear part, negative for transforms that mirror.
+    double determinant() const {
+        return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+             - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+             + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    }
+
+    // True if the linear part is the identity, so the transform only moves.
+    bool is_translation() const {
+        for (int r = 0; r < 3; ++r)
+            for (int c = 0; c < 3; ++c)
+                if (m[r][c] != (r == c ? 1.0 : 0.0))
+                    return false;
+        return true;
+    }
+};
+
+// The transform that applies b, then a.
+mat34 operator*(const mat34& a, const mat34& b) {
+    mat34 t;
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            t.m[r][c] = a.m[r][0]*b.m[0][c] + a.m[r][1]*b.m[1][c] + a.m[r][2]*b.m[2][c];
+            if (c == 3)
+                t.m[r][c] += a.m[r][3];
+        }
+    }
+    return t;
+}
+
+// Inverse of an invertible transform: the inverse linear part, from its
+// adjugate, and the translation taken back through it.
+mat34 inverse(const mat34& a) {
+    const double (*m)[4] = a.m;
+    mat34 t;
+    t.m[0][0] = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+    t.m[0][1] = m[0][2]*m[2][1] - m[0][1]*m[2][2];
+    t.m[0][2] = m[0][1]*m[1][2] - m[0][2]*m[1][1];
+    t.m[1][0] = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+    t.m[1][1] = m[0][0]*m[2][2] - m[0][2]*m[2][0];
+    t.m[1][2] = m[0][2]*m[1][0] - m[0][0]*m[1][2];
+    t.m[2][0] = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+    t.m[2][1] = m[0][1]*m[2][0] - m[0][0]*m[2][1];
+    t.m[2][2] = m[0][0]*m[1][1] - m[0][1]*m[1][0];
+
+    double determinant = m[0][0]*t.m[0][0] + m[0][1]*t.m[1][0] + m[0][2]*t.m[2][0];
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 3; ++c)
+            t.m[r][c] /= determinant;
+    for (int r = 0; r < 3; ++r)
+        t.m[r][3] = -(t.m[r][0]*m[0][3] + t.m[r][1]*m[1][3] + t.m[r][2]*m[2][3]);
+    return t;
+}
+
+// Bounding box of the eight transformed corners of box.
+aabb transform_box(const mat34& t, const aabb& box) {
+    aabb result = aabb::empty();
+    for (int i = 0; i < 8; ++i) {
+        point3 corner((i & 1 ? box.max() : box.min()).x(),
+                      (i & 2 ? box.max() : box.min()).y(),
+                      (i & 4 ? box.max() : box.min()).z());
+        point3 p = t.point(corner);
+        result = surrounding_box(result, aabb(p, p));
+    }
+    return result;
+}
+
+#endif
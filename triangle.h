@@ -5,9 +5,28 @@
 #include "vec3.h"
 #include "Eigen/Dense"
 
+#include <string>
+
 using Eigen::Matrix3f;
 using Eigen::Vector3f;
 
+enum class triangle_test {
+    barycentric,    // solve for the barycentric coordinates with a 3x3 inverse
+    watertight,     // Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection"
+    packet          // Möller-Trumbore on 4 or 8 mesh triangles at once, see
+                    // triangle_packet.h; watertight for single triangles
+};
+
+bool parse_triangle_test(const std::string& name, triangle_test& test) {
+    if (name == "barycentric")     test = triangle_test::barycentric;
+    else if (name == "watertight") test = triangle_test::watertight;
+    else if (name == "packet")     test = triangle_test::packet;
+    else return false;
+    return true;
+}
+
+// Intersection test used by every triangle; set before rendering starts.
+triangle_test triangle_method = triangle_test::watertight;
 
 class triangle : public hittable {
     public:
@@ -16,11 +35,16 @@ class triangle : public hittable {
         };
 
         virtual bool hit(
-            const ray& r, double t_min, double t_max, hit_data& rec) const override;
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual void surface(const ray& r, hit_data& rec) const override;
+
+        bool hit_barycentric(const ray& r, real t_min, real t_max, hit_data& data) const;
+        bool hit_watertight(const ray& r, real t_min, real t_max, hit_data& data) const;
 
+    private:
 
     public:
         point3 point_a;
@@ -32,8 +56,20 @@ class triangle : public hittable {
         shared_ptr<material> material_pointer;
 };
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_data& data) const {
-    // using barycentric
+bool triangle::hit(const ray& r, real t_min, real t_max, hit_data& data) const {
+    if (triangle_method == triangle_test::barycentric)
+        return hit_barycentric(r, t_min, t_max, data);
+    return hit_watertight(r, t_min, t_max, data);
+}
+
+// Solves for the barycentric coordinates of the ray's hit on the plane of
+// (point_a, point_b, point_c) with a 3x3 inverse. Returns false if the hit is
+// outside the triangle or not beyond t_min; otherwise sets t and the weights
+// of the three points. t_max is left to the caller.
+bool solve_barycentric(
+    const ray& r, const point3& point_a, const point3& point_b, const point3& point_c,
+    real t_min, float& t, float weights[3]
+) {
     Matrix3f A;
     A(0) = point_a[0] - point_b[0];
 	A(1) = point_a[1] - point_b[1];
@@ -53,33 +89,97 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_data& data) con
         return false;
     }
 
-    // without this conditional causes image that is named trianglebug.ppm
-    if (x[2] < data.t || t_max == infinity) {
+    t = x[2];
+    weights[0] = 1 - (x[0] + x[1]);
+    weights[1] = x[0];
+    weights[2] = x[1];
+    return true;
+}
+
+// Watertight test of Woop, Benthin and Wald. The ray is moved to the origin
+// and sheared so that it points along +z; the 2D edge functions of the
+// projected triangle then give the scaled barycentric coordinates directly.
+// An edge shared by two triangles is evaluated the same way for both, so rays
+// can't slip through the crack between them. On a hit within (t_min, t_max)
+// sets t and the weights of the three points.
+template <typename T>
+inline bool intersect_watertight(
+    const basic_ray<T>& r, const basic_vec3<T>& point_a, const basic_vec3<T>& point_b, const basic_vec3<T>& point_c,
+    T t_min, T t_max, T& t, T weights[3]
+) {
+    const int kx = r.axis[0], ky = r.axis[1], kz = r.axis[2];
+    const basic_vec3<T> a = point_a - r.origin();
+    const basic_vec3<T> b = point_b - r.origin();
+    const basic_vec3<T> c = point_c - r.origin();
+
+    const T ax = a[kx] - r.shear[0]*a[kz], ay = a[ky] - r.shear[1]*a[kz];
+    const T bx = b[kx] - r.shear[0]*b[kz], by = b[ky] - r.shear[1]*b[kz];
+    const T cx = c[kx] - r.shear[0]*c[kz], cy = c[ky] - r.shear[1]*c[kz];
+
+    // Edge functions of the edges opposite a, b and c.
+    const T u = cx*by - cy*bx;
+    const T v = ax*cy - ay*cx;
+    const T w = bx*ay - by*ax;
+
+    // Mixed signs mean the ray passes outside; either winding is a hit.
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+
+    const T det = u + v + w;
+    if (det == 0)
+        return false;
+
+    const T inv_det = 1 / det;
+    t = (u*a[kz] + v*b[kz] + w*c[kz]) * r.shear[2] * inv_det;
+    if (!(t > t_min && t < t_max))
+        return false;
+
+    weights[0] = u * inv_det;
+    weights[1] = v * inv_det;
+    weights[2] = w * inv_det;
+    return true;
+}
+
+bool triangle::hit_barycentric(const ray& r, real t_min, real t_max, hit_data& data) const {
+    // using barycentric
+    float t, weights[3];
+    // Callers pass the closest hit so far as t_max, so farther hits are
+    // rejected here; without it see trianglebug.ppm. data.t may be unset.
+    if (!solve_barycentric(r, point_a, point_b, point_c, t_min, t, weights) || !(t < t_max))
+        return false;
+
+    data.set_hit(t, this, 0, weights[1], weights[2]);
+    return true;
+}
+
+bool triangle::hit_watertight(const ray& r, real t_min, real t_max, hit_data& data) const {
+    real t, weights[3];
+    if (!intersect_watertight(r, point_a, point_b, point_c, t_min, t_max, t, weights))
+        return false;
+
+    data.set_hit(t, this, 0, weights[1], weights[2]);
+    return true;
+}
+
+// The weights of point_b and point_c are data.u and data.v.
+void triangle::surface(const ray& r, hit_data& data) const {
+    real alpha = 1 - data.u - data.v, beta = data.u, gamma = data.v;
+    data.hit_point = r.at(data.t);
+    if (normal_a[0] == 0 && normal_a[1] == 0 && normal_a[2] ==0 ){
         vec3 triangle_vec_1 = point_a - point_b;
         vec3 triangle_vec_2 = point_c - point_b;
-
-        data.t = x[2];
-        data.hit_point = r.at(data.t);
-        if (normal_a[0] == 0 && normal_a[1] == 0 && normal_a[2] ==0 ){
-            vec3 outward_normal = cross(triangle_vec_2, triangle_vec_1);
-            data.set_face_normal(r, outward_normal);
-        }
-        else{
-            float alpha = 1 - (x[0] + x[1]);
-            vec3 interpolation = alpha*(unit_vector(normal_a)) + x[0]*(unit_vector(normal_b)) + x[1]*(unit_vector(normal_c));
-            data.hit_normal = unit_vector(interpolation);
-        }
-        data.material_pointer = material_pointer;
-
-        return true;
+        vec3 outward_normal = cross(triangle_vec_2, triangle_vec_1);
+        data.set_face_normal(r, outward_normal);
     }
-    else
-
-    return false;
+    else{
+        vec3 interpolation = alpha*(unit_vector(normal_a)) + beta*(unit_vector(normal_b)) + gamma*(unit_vector(normal_c));
+        data.hit_normal = unit_vector(interpolation);
+    }
+    data.material_pointer = material_pointer.get();
 }
 
 // Alternative triangle hit method
-// bool triangle::hit(const ray& r, double t_min, double t_max, hit_data& data) const {
+// bool triangle::hit(const ray& r, real t_min, real t_max, hit_data& data) const {
 //     const float EPSILON = 0.0000001;
 
 //     float a,f,u,v;
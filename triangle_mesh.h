@@ -0,0 +1,375 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "mesh.h"
+#include "parallel.h"
+#include "triangle.h"
+#include "triangle_packet.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A whole triangle mesh as one hittable with one material. The triangles are
+// referenced by index from an internal BVH of layout tree_type (linear_bvh or
+// wide_bvh), and the index buffer is kept in leaf order so that a leaf is a
+// contiguous run of triangles. With the packet triangle test every leaf is
+// instead stored as packets of triangles in SIMD-friendly layout. hit()
+// records the closest triangle and its barycentric coordinates; surface()
+// interpolates the normal.
+template <typename tree_type>
+class indexed_mesh : public hittable {
+    public:
+        // With a bvh_cache_path, the BVH is read from that file if it was
+        // built from the same triangles and settings, and written there
+        // otherwise.
+        indexed_mesh(mesh_data data, shared_ptr<material> m, const bvh_build_options& options,
+                     const std::string& bvh_cache_path = std::string());
+
+        virtual bool hit(
+            const ray& r, real t_min, real t_max, hit_data& rec) const override;
+
+        virtual bool occluded(const ray& r, real t_min, real t_max) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = tree.bounds();
+            return !tree.empty();
+        }
+
+        virtual void surface(const ray& r, hit_data& rec) const override;
+
+        // Transforms the vertices and normals and refits the BVH, whose
+        // structure stays the same. Meshes packed for the packet test keep
+        // their transform.
+        virtual bool apply_transform(const mat34& t) override;
+
+        // Exact box of the transformed vertices.
+        virtual bool transformed_box(const mat34& t, aabb& output_box) const override {
+            output_box = aabb::empty();
+            for (size_t v = 0; v < geometry.vertex_count(); ++v) {
+                point3 p = t.point(vertex(static_cast<uint32_t>(v)));
+                output_box = surrounding_box(output_box, aabb(p, p));
+            }
+            return !tree.empty();
+        }
+
+        size_t memory_bytes() const {
+            return sizeof(float) * (geometry.positions.size() + geometry.normals.size())
+                 + sizeof(uint32_t) * geometry.indices.size()
+                 + sizeof(tree.nodes[0]) * tree.nodes.size()
+                 + sizeof(triangle_packet<triangle_packet_width>) * packets.size();
+        }
+
+    private:
+        point3 vertex(uint32_t v) const {
+            const float* p = &geometry.positions[3*v];
+            return point3(p[0], p[1], p[2]);
+        }
+
+        vec3 vertex_normal(uint32_t v) const {
+            const float* n = &geometry.normals[3*v];
+            return vec3(n[0], n[1], n[2]);
+        }
+
+        // Intersects triangle k with the selected triangle test. On a hit
+        // within (t_min, t_max) sets t and the barycentric weights.
+        bool hit_triangle(const ray& r, uint32_t k, real t_min, real t_max, real& t, real weights[3]) const {
+            const uint32_t* v = &geometry.indices[3*k];
+            auto a = vertex(v[0]), b = vertex(v[1]), c = vertex(v[2]);
+            if (triangle_method != triangle_test::barycentric)
+                return intersect_watertight(r, a, b, c, t_min, t_max, t, weights);
+
+            float solved_t, solved_weights[3];
+            if (!solve_barycentric(r, a, b, c, t_min, solved_t, solved_weights) || !(solved_t < t_max))
+                return false;
+            t = solved_t;
+            for (int i = 0; i < 3; ++i)
+                weights[i] = solved_weights[i];
+            return true;
+        }
+
+        // Builds tree over the triangles in their original order.
+        void build_tree(const bvh_build_options& options);
+
+        // Packs the triangles of every leaf into packets and points the
+        // leaves at their packets.
+        void build_packets();
+
+    public:
+        mesh_data geometry;
+        shared_ptr<material> material_pointer;
+        tree_type tree;
+        std::vector<triangle_packet<triangle_packet_width>> packets;    // empty unless packed
+        bool bvh_from_cache = false;
+};
+
+template <typename tree_type>
+indexed_mesh<tree_type>::indexed_mesh(mesh_data data, shared_ptr<material> m, const bvh_build_options& options,
+                                      const std::string& bvh_cache_path)
+    : geometry(std::move(data)), material_pointer(m)
+{
+    size_t count = geometry.triangle_count();
+
+    // A packet is tested as cheaply as one triangle, so leaves may be as
+    // large as a packet.
+    auto tree_options = options;
+    if (triangle_method == triangle_test::packet)
+        tree_options.max_leaf_size = std::max(options.max_leaf_size, triangle_packet_width);
+
+    uint64_t key = 0;
+    if (!bvh_cache_path.empty()) {
+        key = bvh_cache_key(geometry, tree_options, sizeof(tree.nodes[0]));
+        bvh_from_cache = load_bvh_cache(tree, key, count, bvh_cache_path);
+    }
+    if (!bvh_from_cache)
+        build_tree(tree_options);
+    if (!bvh_from_cache && !bvh_cache_path.empty())
+        save_bvh_cache(tree, key, bvh_cache_path);
+
+    // Put the triangles in leaf order; the leaves then refer to them directly
+    // and the tree's own index array is no longer needed.
+    std::vector<uint32_t> ordered(geometry.indices.size());
+    for (size_t k = 0; k < count; ++k)
+        for (int i = 0; i < 3; ++i)
+            ordered[3*k + i] = geometry.indices[3*size_t(tree.indices[k]) + i];
+    geometry.indices = array_view<uint32_t>(std::move(ordered));
+    std::vector<uint32_t>().swap(tree.indices);
+
+    if (triangle_method == triangle_test::packet)
+        build_packets();
+}
+
+template <typename tree_type>
+void indexed_mesh<tree_type>::build_tree(const bvh_build_options& options) {
+    size_t count = geometry.triangle_count();
+    std::vector<bvh_primitive> prims(count);
+    parallel_for(count, options.threads, min_parallel_build_size, [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            const uint32_t* v = &geometry.indices[3*k];
+            auto a = vertex(v[0]), b = vertex(v[1]), c = vertex(v[2]);
+            point3 lo(fmin(a.x(), fmin(b.x(), c.x())), fmin(a.y(), fmin(b.y(), c.y())), fmin(a.z(), fmin(b.z(), c.z())));
+            point3 hi(fmax(a.x(), fmax(b.x(), c.x())), fmax(a.y(), fmax(b.y(), c.y())), fmax(a.z(), fmax(b.z(), c.z())));
+            prims[k].box = aabb(lo, hi);
+            prims[k].centroid = prims[k].box.centroid();
+            prims[k].index = static_cast<uint32_t>(k);
+        }
+    });
+    tree.build(prims, options);
+}
+
+template <typename tree_type>
+bool indexed_mesh<tree_type>::apply_transform(const mat34& t) {
+    if (!packets.empty())
+        return false;
+
+    // The arrays may be shared with a mesh cache mapping, so the transformed
+    // geometry goes into new ones.
+    mat34 normal_transform = inverse(t);
+    std::vector<float> positions(geometry.positions.size()), normals(geometry.normals.size());
+    for (size_t v = 0; v < geometry.vertex_count(); ++v) {
+        point3 p = t.point(vertex(static_cast<uint32_t>(v)));
+        for (int a = 0; a < 3; ++a)
+            positions[3*v + a] = static_cast<float>(p[a]);
+        if (!normals.empty()) {
+            vec3 n = unit_vector(normal_transform.transposed_vector(vertex_normal(static_cast<uint32_t>(v))));
+            for (int a = 0; a < 3; ++a)
+                normals[3*v + a] = static_cast<float>(n[a]);
+        }
+    }
+    geometry.positions = array_view<float>(std::move(positions));
+    geometry.normals = array_view<float>(std::move(normals));
+
+    // A mirroring transform reverses the winding of every triangle, which
+    // gives the geometric normal of meshes without vertex normals, so that
+    // is swapped back. The triangles keep their numbers, and with them the
+    // tree.
+    if (t.determinant() < 0) {
+        std::vector<uint32_t> indices(geometry.indices.begin(), geometry.indices.end());
+        for (size_t k = 0; k < indices.size(); k += 3)
+            std::swap(indices[k + 1], indices[k + 2]);
+        geometry.indices = array_view<uint32_t>(std::move(indices));
+    }
+
+    tree.refit([&](uint32_t first, uint32_t count) {
+        aabb box = aabb::empty();
+        for (uint32_t k = first; k < first + count; ++k)
+            for (int i = 0; i < 3; ++i) {
+                point3 p = vertex(geometry.indices[3*size_t(k) + i]);
+                box = surrounding_box(box, aabb(p, p));
+            }
+        return box;
+    });
+    return true;
+}
+
+template <typename tree_type>
+void indexed_mesh<tree_type>::build_packets() {
+    const int width = triangle_packet_width;
+    tree.remap_leaves([&](uint32_t& first, uint16_t& count) {
+        auto packet_first = static_cast<uint32_t>(packets.size());
+        for (uint32_t k = first; k < first + count; k += width) {
+            triangle_packet<width> p;
+            for (int lane = 0; lane < width; ++lane) {
+                uint32_t id = k + lane < first + count ? k + lane : k;
+                const uint32_t* v = &geometry.indices[3*id];
+                auto a = vertex(v[0]), b = vertex(v[1]), c = vertex(v[2]);
+                bool used = k + lane < first + count;
+                for (int axis = 0; axis < 3; ++axis) {
+                    p.vertex[axis][lane] = static_cast<float>(a[axis]);
+                    p.edge1[axis][lane] = used ? static_cast<float>(b[axis] - a[axis]) : 0.0f;
+                    p.edge2[axis][lane] = used ? static_cast<float>(c[axis] - a[axis]) : 0.0f;
+                }
+                p.id[lane] = id;
+            }
+            packets.push_back(p);
+        }
+        count = static_cast<uint16_t>(packets.size() - packet_first);
+        first = packet_first;
+    });
+}
+
+template <typename tree_type>
+bool indexed_mesh<tree_type>::hit(const ray& r, real t_min, real t_max, hit_data& rec) const {
+    uint32_t closest = 0;
+    real closest_t = t_max;
+    real closest_u = 0, closest_v = 0;
+    bool hit_anything;
+
+    if (!packets.empty()) {
+        packet_ray pr(r);
+        hit_anything = tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count, real& t_closest) {
+            bool hit_leaf = false;
+            for (uint32_t k = first; k < first + count; ++k) {
+                float t, u, v;
+                int lane = intersect_packet(packets[k], pr, static_cast<float>(t_min), static_cast<float>(t_closest), t, u, v);
+                if (lane >= 0) {
+                    hit_leaf = true;
+                    t_closest = closest_t = t;
+                    closest = packets[k].id[lane];
+                    closest_u = u;
+                    closest_v = v;
+                }
+            }
+            return hit_leaf;
+        });
+    } else {
+        hit_anything = tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count, real& t_closest) {
+            bool hit_leaf = false;
+            for (uint32_t k = first; k < first + count; ++k) {
+                real t, w[3];
+                if (hit_triangle(r, k, t_min, t_closest, t, w)) {
+                    hit_leaf = true;
+                    t_closest = closest_t = t;
+                    closest = k;
+                    closest_u = w[1];
+                    closest_v = w[2];
+                }
+            }
+            return hit_leaf;
+        });
+    }
+
+    if (!hit_anything)
+        return false;
+    rec.set_hit(closest_t, this, closest, closest_u, closest_v);
+    return true;
+}
+
+// Stops at the first triangle that blocks the ray, wherever it is.
+template <typename tree_type>
+bool indexed_mesh<tree_type>::occluded(const ray& r, real t_min, real t_max) const {
+    if (!packets.empty()) {
+        packet_ray pr(r);
+        return tree.traverse_any(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+            for (uint32_t k = first; k < first + count; ++k) {
+                float t, u, v;
+                if (intersect_packet(packets[k], pr, static_cast<float>(t_min), static_cast<float>(t_max), t, u, v) >= 0)
+                    return true;
+            }
+            return false;
+        });
+    }
+
+    return tree.traverse_any(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t k = first; k < first + count; ++k) {
+            real t, w[3];
+            if (hit_triangle(r, k, t_min, t_max, t, w))
+                return true;
+        }
+        return false;
+    });
+}
+
+template <typename tree_type>
+void indexed_mesh<tree_type>::surface(const ray& r, hit_data& rec) const {
+    const uint32_t* v = &geometry.indices[3*rec.primitive];
+    real weights[3] = {1 - rec.u - rec.v, rec.u, rec.v};
+    rec.hit_point = r.at(rec.t);
+    if (geometry.normals.empty()) {
+        auto a = vertex(v[0]), b = vertex(v[1]), c = vertex(v[2]);
+        rec.set_face_normal(r, cross(c - b, a - b));
+    } else {
+        auto normal = weights[0]*vertex_normal(v[0]) + weights[1]*vertex_normal(v[1]) + weights[2]*vertex_normal(v[2]);
+        rec.set_face_normal(r, unit_vector(normal));
+    }
+    rec.material_pointer = material_pointer.get();
+}
+
+// Builds an indexed mesh whose BVH has the layout of options, see
+// indexed_mesh for bvh_cache_path. There is no linked layout for meshes, so
+// tree uses the flat one.
+shared_ptr<hittable> make_indexed_mesh(mesh_data data, shared_ptr<material> m, const bvh_build_options& options,
+                                       const std::string& bvh_cache_path = std::string()) {
+    auto started = std::chrono::steady_clock::now();
+    size_t triangles = data.triangle_count();
+    size_t vertices = data.vertex_count();
+    size_t bytes = 0;
+    bool cached = false;
+    shared_ptr<hittable> result;
+
+    switch (options.layout) {
+        case bvh_layout::wide4: {
+            auto mesh = make_shared<indexed_mesh<wide_bvh<4>>>(std::move(data), m, options, bvh_cache_path);
+            bytes = mesh->memory_bytes();
+            cached = mesh->bvh_from_cache;
+            result = mesh;
+            break;
+        }
+        case bvh_layout::wide8: {
+            auto mesh = make_shared<indexed_mesh<wide_bvh<8>>>(std::move(data), m, options, bvh_cache_path);
+            bytes = mesh->memory_bytes();
+            cached = mesh->bvh_from_cache;
+            result = mesh;
+            break;
+        }
+        default: {
+            auto mesh = make_shared<indexed_mesh<linear_bvh>>(std::move(data), m, options, bvh_cache_path);
+            bytes = mesh->memory_bytes();
+            cached = mesh->bvh_from_cache;
+            result = mesh;
+            break;
+        }
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+    std::ostringstream report;
+    report << "Mesh: " << triangles << " triangles, " << vertices << " vertices, "
+           << bytes / (1024.0 * 1024.0) << " MB with its BVH, " << (cached ? "BVH read from cache" : "built")
+           << " in " << elapsed.count() << " ms\n";
+    std::cerr << report.str();
+    return result;
+}
+
+#endif
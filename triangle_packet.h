@@ -0,0 +1,185 @@
+#ifndef TRIANGLE_PACKET_H
+#define TRIANGLE_PACKET_H
+
+#include "utility.h"
+
+#include <cstdint>
+
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// Triangles per packet: eight where AVX is available, four otherwise.
+#ifdef __AVX__
+const int triangle_packet_width = 8;
+#else
+const int triangle_packet_width = 4;
+#endif
+
+// `width` triangles in structure of arrays layout, with their edges
+// precomputed for the Möller-Trumbore test: vertex[axis][lane] is the first
+// vertex, edge1 and edge2 point from it to the second and third. id is the
+// index of the triangle in the mesh. Unused lanes have zero edges, which no
+// ray can hit.
+template <int width>
+struct triangle_packet {
+    float vertex[3][width];
+    float edge1[3][width];
+    float edge2[3][width];
+    uint32_t id[width];
+};
+
+// A ray in single precision for the packet tests.
+struct packet_ray {
+    packet_ray(const ray& r) {
+        for (int a = 0; a < 3; ++a) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            direction[a] = static_cast<float>(r.direction()[a]);
+        }
+    }
+
+    float origin[3];
+    float direction[3];
+};
+
+// Picks the nearest lane of mask from the per-lane results.
+template <int width>
+int nearest_lane(int mask, const float* t, const float* u, const float* v, float& t_hit, float& u_hit, float& v_hit) {
+    int nearest = -1;
+    for (int lane = 0; lane < width; ++lane) {
+        if ((mask & (1 << lane)) && (nearest < 0 || t[lane] < t_hit)) {
+            nearest = lane;
+            t_hit = t[lane];
+        }
+    }
+    if (nearest >= 0) {
+        u_hit = u[nearest];
+        v_hit = v[nearest];
+    }
+    return nearest;
+}
+
+// Möller-Trumbore test of r against every triangle of p. Returns the lane of
+// the nearest hit within (t_min, t_max), or -1, and sets its distance and its
+// barycentric weights u and v of the second and third vertex.
+template <int width>
+int intersect_packet_scalar(
+    const triangle_packet<width>& p, const packet_ray& r, float t_min, float t_max,
+    float& t_hit, float& u_hit, float& v_hit
+) {
+    const float* o = r.origin;
+    const float* d = r.direction;
+    float t[width], u[width], v[width];
+    int mask = 0;
+    for (int lane = 0; lane < width; ++lane) {
+        float e1[3] = {p.edge1[0][lane], p.edge1[1][lane], p.edge1[2][lane]};
+        float e2[3] = {p.edge2[0][lane], p.edge2[1][lane], p.edge2[2][lane]};
+        float s[3] = {o[0] - p.vertex[0][lane], o[1] - p.vertex[1][lane], o[2] - p.vertex[2][lane]};
+
+        float pv[3] = {d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0]};
+        float qv[3] = {s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0]};
+        float inv_det = 1.0f / (e1[0]*pv[0] + e1[1]*pv[1] + e1[2]*pv[2]);
+
+        u[lane] = (s[0]*pv[0] + s[1]*pv[1] + s[2]*pv[2]) * inv_det;
+        v[lane] = (d[0]*qv[0] + d[1]*qv[1] + d[2]*qv[2]) * inv_det;
+        t[lane] = (e2[0]*qv[0] + e2[1]*qv[1] + e2[2]*qv[2]) * inv_det;
+        if (u[lane] >= 0 && v[lane] >= 0 && u[lane] + v[lane] <= 1 && t[lane] > t_min && t[lane] < t_max)
+            mask |= 1 << lane;
+    }
+    return nearest_lane<width>(mask, t, u, v, t_hit, u_hit, v_hit);
+}
+
+inline int intersect_packet(
+    const triangle_packet<4>& p, const packet_ray& r, float t_min, float t_max,
+    float& t_hit, float& u_hit, float& v_hit
+) {
+#ifdef __SSE__
+    const __m128 dx = _mm_set1_ps(r.direction[0]);
+    const __m128 dy = _mm_set1_ps(r.direction[1]);
+    const __m128 dz = _mm_set1_ps(r.direction[2]);
+    const __m128 e1x = _mm_loadu_ps(p.edge1[0]), e1y = _mm_loadu_ps(p.edge1[1]), e1z = _mm_loadu_ps(p.edge1[2]);
+    const __m128 e2x = _mm_loadu_ps(p.edge2[0]), e2y = _mm_loadu_ps(p.edge2[1]), e2z = _mm_loadu_ps(p.edge2[2]);
+    const __m128 sx = _mm_sub_ps(_mm_set1_ps(r.origin[0]), _mm_loadu_ps(p.vertex[0]));
+    const __m128 sy = _mm_sub_ps(_mm_set1_ps(r.origin[1]), _mm_loadu_ps(p.vertex[1]));
+    const __m128 sz = _mm_sub_ps(_mm_set1_ps(r.origin[2]), _mm_loadu_ps(p.vertex[2]));
+
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+    // Comparisons with NaN are false, so degenerate and empty lanes drop out.
+    const __m128 zero = _mm_setzero_ps();
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, _mm_set1_ps(t_min)));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(t_max)));
+    int mask = _mm_movemask_ps(valid);
+    if (mask == 0)
+        return -1;
+
+    float ts[4], us[4], vs[4];
+    _mm_storeu_ps(ts, t);
+    _mm_storeu_ps(us, u);
+    _mm_storeu_ps(vs, v);
+    return nearest_lane<4>(mask, ts, us, vs, t_hit, u_hit, v_hit);
+#else
+    return intersect_packet_scalar(p, r, t_min, t_max, t_hit, u_hit, v_hit);
+#endif
+}
+
+inline int intersect_packet(
+    const triangle_packet<8>& p, const packet_ray& r, float t_min, float t_max,
+    float& t_hit, float& u_hit, float& v_hit
+) {
+#ifdef __AVX__
+    const __m256 dx = _mm256_set1_ps(r.direction[0]);
+    const __m256 dy = _mm256_set1_ps(r.direction[1]);
+    const __m256 dz = _mm256_set1_ps(r.direction[2]);
+    const __m256 e1x = _mm256_loadu_ps(p.edge1[0]), e1y = _mm256_loadu_ps(p.edge1[1]), e1z = _mm256_loadu_ps(p.edge1[2]);
+    const __m256 e2x = _mm256_loadu_ps(p.edge2[0]), e2y = _mm256_loadu_ps(p.edge2[1]), e2z = _mm256_loadu_ps(p.edge2[2]);
+    const __m256 sx = _mm256_sub_ps(_mm256_set1_ps(r.origin[0]), _mm256_loadu_ps(p.vertex[0]));
+    const __m256 sy = _mm256_sub_ps(_mm256_set1_ps(r.origin[1]), _mm256_loadu_ps(p.vertex[1]));
+    const __m256 sz = _mm256_sub_ps(_mm256_set1_ps(r.origin[2]), _mm256_loadu_ps(p.vertex[2]));
+
+    const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+
+    const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    const __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    const __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv_det);
+    const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+    const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+    int mask = _mm256_movemask_ps(valid);
+    if (mask == 0)
+        return -1;
+
+    float ts[8], us[8], vs[8];
+    _mm256_storeu_ps(ts, t);
+    _mm256_storeu_ps(us, u);
+    _mm256_storeu_ps(vs, v);
+    return nearest_lane<8>(mask, ts, us, vs, t_hit, u_hit, v_hit);
+#else
+    return intersect_packet_scalar(p, r, t_min, t_max, t_hit, u_hit, v_hit);
+#endif
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <cmath>
 #include <limits>
 #include <memory>
+#include <cstdint>
 #include <cstdlib>
 
 
@@ -24,9 +25,40 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// Random Numbers
+
+// Counter-based generator: every value is a hash of (key, counter). The key is
+// derived from the pixel and sample being rendered and the counter is the
+// dimension, i.e. how many numbers that sample has drawn so far. A sample's
+// random stream therefore does not depend on which thread renders it or in
+// which order the tiles are processed, so renders are reproducible.
+struct sample_rng {
+    uint64_t key = 0;
+    uint64_t counter = 0;
+
+    static uint64_t mix(uint64_t z) {
+        // splitmix64 finalizer
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t next() {
+        return mix(key + (++counter) * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// Each render thread has its own generator, so drawing numbers never contends.
+thread_local sample_rng rng;
+
+inline void seed_sample(uint64_t pixel, uint64_t sample, uint64_t dimension = 0) {
+    rng.key = sample_rng::mix(sample_rng::mix(pixel + 0x632be59bd9b4e019ULL) ^ sample);
+    rng.counter = dimension;
+}
+
 inline double random_double() {
-    // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1), using the top 53 bits of the next value.
+    return (rng.next() >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double random_double(double min, double max) {
@@ -4,60 +4,72 @@
 #include <cmath>
 #include <iostream>
 
+#include "precision.h"
+
 using std::sqrt;
 using std::fabs;
 
-class vec3 {
+// Three component vector of scalar type T, used for points, directions and
+// colors.
+template <typename T>
+class basic_vec3 {
     public:
-        double e[3];
-        vec3() : e{0,0,0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        typedef T value_type;
+
+        T e[3];
+        basic_vec3() : e{0,0,0} {}
+        basic_vec3(T e0, T e1, T e2) : e{e0, e1, e2} {}
+
+        // Conversion between precisions.
+        template <typename U>
+        explicit basic_vec3(const basic_vec3<U>& v)
+            : e{static_cast<T>(v.e[0]), static_cast<T>(v.e[1]), static_cast<T>(v.e[2])} {}
 
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
 
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
+        basic_vec3 operator-() const { return basic_vec3(-e[0], -e[1], -e[2]); }
+        T operator[](int i) const { return e[i]; }
+        T& operator[](int i) { return e[i]; }
 
-        vec3& operator+=(const vec3 &v) {
+        basic_vec3& operator+=(const basic_vec3 &v) {
             e[0] += v.e[0];
             e[1] += v.e[1];
             e[2] += v.e[2];
             return *this;
         }
 
-        vec3& operator*=(const double t) {
+        basic_vec3& operator*=(const T t) {
             e[0] *= t;
             e[1] *= t;
             e[2] *= t;
             return *this;
         }
 
-        vec3& operator/=(const double t) {
+        basic_vec3& operator/=(const T t) {
             return *this *= 1/t;
         }
 
-        double length() const {
+        T length() const {
             return sqrt(length_squared());
         }
 
-        double length_squared() const {
+        T length_squared() const {
             return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
         }
 
-        inline static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        inline static basic_vec3 random() {
+            return basic_vec3(random_double(), random_double(), random_double());
         }
 
-        inline static vec3 random(double min, double max) {
-            return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+        inline static basic_vec3 random(double min, double max) {
+            return basic_vec3(random_double(min,max), random_double(min,max), random_double(min,max));
         }
 
         bool near_zero() const {
             // Return true if the vector is close to zero in all dimensions.
-            const auto s = 1e-8;
+            const auto s = scalar_traits<T>::near_zero();
             return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
         }
 
@@ -65,53 +77,66 @@ class vec3 {
 
 
 // Type aliases for vec3
-using point3 = vec3;   // 3D point
-using color = vec3;    // RGB color
+using vec3 = basic_vec3<real>;
+using point3 = vec3;                // 3D point
+using color = basic_vec3<double>;   // RGB color
 
 
 // vec3 Utility Functions
 
-inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream &out, const basic_vec3<T> &v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator+(const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator-(const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+// Scalars take the vector's type, so that a double constant can scale a
+// single precision vector.
+template <typename T>
+inline basic_vec3<T> operator*(typename basic_vec3<T>::value_type t, const basic_vec3<T> &v) {
+    return basic_vec3<T>(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
+template <typename T>
+inline basic_vec3<T> operator*(const basic_vec3<T> &v, typename basic_vec3<T>::value_type t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+template <typename T>
+inline basic_vec3<T> operator/(basic_vec3<T> v, typename basic_vec3<T>::value_type t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v) {
+template <typename T>
+inline T dot(const basic_vec3<T> &u, const basic_vec3<T> &v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+template <typename T>
+inline basic_vec3<T> cross(const basic_vec3<T> &u, const basic_vec3<T> &v) {
+    return basic_vec3<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                         u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline basic_vec3<T> unit_vector(basic_vec3<T> v) {
     return v / v.length();
 }
 
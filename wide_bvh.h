@@ -0,0 +1,420 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "utility.h"
+
+#include "bvh.h"
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// Node of a BVH with up to `width` children per node. The children's bounds
+// are stored as structure of arrays, bounds[row][child] with rows min x, min y,
+// min z, max x, max y, max z, so that one SIMD slab test covers all of them.
+// A child is either another node (count == 0, child is its index) or a leaf
+// (count primitives starting at child in the primitive order). Unused slots
+// have inverted bounds that no ray can enter. 128 bytes for width 4, 256 for
+// width 8.
+template <int width>
+struct wide_bvh_node {
+    float bounds[6][width];
+    uint32_t child[width];
+    uint16_t count[width];
+    uint8_t pad[2 * width];
+};
+
+static_assert(sizeof(wide_bvh_node<4>) == 128, "wide_bvh_node<4> should be 128 bytes");
+static_assert(sizeof(wide_bvh_node<8>) == 256, "wide_bvh_node<8> should be 256 bytes");
+
+// Relative error of a ray origin rounded to single precision, with a factor
+// of two to spare for the rounding of inv_dir and of the product.
+const double slab_origin_error = 1.0 / (1 << 23);
+
+// A ray prepared for slab tests in single precision. near[a] and far[a] are the
+// bounds rows of the slab planes the ray enters and leaves through on axis a.
+// Rounding the origin to float moves every slab distance on axis a by up to
+// |origin| * 2^-24 * |inv_dir|, however close the box is, so the tests widen
+// both ends of the interval by pad[a]. Far from the world origin this is what
+// keeps short secondary rays from missing boxes they start in or graze. An
+// axis the ray is parallel to needs no pad: rounding is monotonic, so an
+// origin inside a slab stays inside the outward rounded one, and neither does
+// an origin that is exact in single precision, as in the float build.
+struct slab_ray {
+    slab_ray(const ray& r) {
+        for (int a = 0; a < 3; ++a) {
+            origin[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+            pad[a] = origin[a] != r.origin()[a] && std::isfinite(inv_dir[a])
+                ? round_up(slab_origin_error * std::fabs(double(r.origin()[a])) * std::fabs(double(r.inv_dir[a])))
+                : 0.0f;
+            near[a] = r.sign[a] ? 3 + a : a;
+            far[a] = r.sign[a] ? a : 3 + a;
+        }
+    }
+
+    float origin[3];
+    float inv_dir[3];
+    float pad[3];
+    int near[3];
+    int far[3];
+};
+
+// Widens the exit distance by a few ulps so that rounding in the single
+// precision slab test, relative to the distances, never culls a box the ray
+// touches.
+const float slab_exit_scale = 1.0000004f;
+
+// Slab test of r against every child of node. Stores the distance at which the
+// ray enters each child in t_near and returns a mask of the children it enters
+// within [t_min, t_max]. Written so that a NaN (zero direction component and
+// a slab boundary at the origin) leaves the interval unchanged.
+template <int width>
+int intersect_children_scalar(
+    const wide_bvh_node<width>& node, const slab_ray& r, float t_min, float t_max, float* t_near
+) {
+    int mask = 0;
+    for (int c = 0; c < width; ++c) {
+        float t0 = t_min;
+        float t1 = t_max;
+        for (int a = 0; a < 3; ++a) {
+            float enter = (node.bounds[r.near[a]][c] - r.origin[a]) * r.inv_dir[a] - r.pad[a];
+            float exit = (node.bounds[r.far[a]][c] - r.origin[a]) * r.inv_dir[a] + r.pad[a];
+            t0 = enter > t0 ? enter : t0;
+            t1 = exit < t1 ? exit : t1;
+        }
+        t_near[c] = t0;
+        if (t0 <= t1 * slab_exit_scale)
+            mask |= 1 << c;
+    }
+    return mask;
+}
+
+inline int intersect_children(
+    const wide_bvh_node<4>& node, const slab_ray& r, float t_min, float t_max, float* t_near
+) {
+#ifdef __SSE__
+    // _mm_max_ps and _mm_min_ps return their second operand if either is NaN.
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; ++a) {
+        __m128 origin = _mm_set1_ps(r.origin[a]);
+        __m128 inv_dir = _mm_set1_ps(r.inv_dir[a]);
+        __m128 pad = _mm_set1_ps(r.pad[a]);
+        __m128 enter = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near[a]]), origin), inv_dir), pad);
+        __m128 exit = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.far[a]]), origin), inv_dir), pad);
+        t0 = _mm_max_ps(enter, t0);
+        t1 = _mm_min_ps(exit, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(slab_exit_scale))));
+#else
+    return intersect_children_scalar(node, r, t_min, t_max, t_near);
+#endif
+}
+
+inline int intersect_children(
+    const wide_bvh_node<8>& node, const slab_ray& r, float t_min, float t_max, float* t_near
+) {
+#ifdef __AVX__
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    for (int a = 0; a < 3; ++a) {
+        __m256 origin = _mm256_set1_ps(r.origin[a]);
+        __m256 inv_dir = _mm256_set1_ps(r.inv_dir[a]);
+        __m256 pad = _mm256_set1_ps(r.pad[a]);
+        __m256 enter = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near[a]]), origin), inv_dir), pad);
+        __m256 exit = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.far[a]]), origin), inv_dir), pad);
+        t0 = _mm256_max_ps(enter, t0);
+        t1 = _mm256_min_ps(exit, t1);
+    }
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, _mm256_mul_ps(t1, _mm256_set1_ps(slab_exit_scale)), _CMP_LE_OQ));
+#else
+    return intersect_children_scalar(node, r, t_min, t_max, t_near);
+#endif
+}
+
+// BVH with `width` children per node, made by collapsing a binary linear_bvh:
+// starting from a node's two children, the interior child with the largest
+// surface area is replaced by its own children until the node is full. Leaves
+// and the primitive order are those of the binary tree.
+template <int width>
+class wide_bvh {
+    public:
+        wide_bvh() {}
+
+        // Builds the tree over prims, which is reordered in place.
+        void build(std::vector<bvh_primitive>& prims, const bvh_build_options& options) {
+            linear_bvh binary;
+            binary.build(prims, options);
+
+            nodes.clear();
+            nodes.reserve(binary.nodes.size() / (width - 1) + 1);
+            if (!binary.empty())
+                collapse(binary, 0);
+            nodes.shrink_to_fit();
+            indices.swap(binary.indices);
+        }
+
+        bool empty() const { return nodes.empty(); }
+
+        aabb bounds() const {
+            if (nodes.empty()) return aabb::empty();
+            return node_box(nodes[0]);
+        }
+
+        // Same contract as linear_bvh::traverse(). The children a ray enters
+        // are visited in order of their entry distance, and children further
+        // away than the closest hit found so far are skipped.
+        template <typename leaf_function>
+        bool traverse(const ray& r, real t_min, real t_max, const leaf_function& leaf) const {
+            if (nodes.empty())
+                return false;
+
+            struct entry {
+                uint32_t child;
+                uint32_t count;
+                float t;
+            };
+
+            slab_ray sr(r);
+            entry stack[stack_size];
+            int size = 0;
+            stack[size++] = {0, 0, static_cast<float>(t_min)};
+            bool hit_anything = false;
+
+            while (size > 0) {
+                entry e = stack[--size];
+                if (e.t > t_max)
+                    continue;
+
+                if (e.count > 0) {
+                    if (leaf(e.child, e.count, t_max))
+                        hit_anything = true;
+                    continue;
+                }
+
+                const auto& node = nodes[e.child];
+                float t_near[width];
+                int mask = intersect_children(node, sr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+
+                // Insert the children far to near, so the nearest is on top.
+                int first = size;
+                // Unused slots (child 0, which is the root, and no leaf) are
+                // skipped even if entered: a NaN ray enters every slot.
+                for (int c = 0; c < width; ++c) {
+                    if (!(mask & (1 << c)) || (node.child[c] == 0 && node.count[c] == 0))
+                        continue;
+                    entry next = {node.child[c], node.count[c], t_near[c]};
+                    int k = size++;
+                    while (k > first && stack[k-1].t < next.t) {
+                        stack[k] = stack[k-1];
+                        --k;
+                    }
+                    stack[k] = next;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        // Same contract as linear_bvh::traverse_any(). The entered children
+        // are visited in slot order, as any hit will do.
+        template <typename leaf_function>
+        bool traverse_any(const ray& r, real t_min, real t_max, const leaf_function& leaf) const {
+            if (nodes.empty())
+                return false;
+
+            struct entry {
+                uint32_t child;
+                uint32_t count;
+            };
+
+            slab_ray sr(r);
+            entry stack[stack_size];
+            int size = 0;
+            stack[size++] = {0, 0};
+
+            while (size > 0) {
+                entry e = stack[--size];
+                if (e.count > 0) {
+                    if (leaf(e.child, e.count))
+                        return true;
+                    continue;
+                }
+
+                const auto& node = nodes[e.child];
+                float t_near[width];
+                int mask = intersect_children(node, sr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+                for (int c = width - 1; c >= 0; --c) {
+                    if ((mask & (1 << c)) && !(node.child[c] == 0 && node.count[c] == 0))
+                        stack[size++] = {node.child[c], node.count[c]};
+                }
+            }
+
+            return false;
+        }
+
+        // Same as linear_bvh::remap_leaves().
+        template <typename remap_function>
+        void remap_leaves(const remap_function& remap) {
+            for (auto& node : nodes)
+                for (int c = 0; c < width; ++c)
+                    if (node.count[c] > 0)
+                        remap(node.child[c], node.count[c]);
+        }
+
+        // Same as linear_bvh::refit(). Unused slots stay empty.
+        template <typename leaf_box_function>
+        void refit(const leaf_box_function& leaf_box) {
+            for (size_t i = nodes.size(); i-- > 0;) {
+                auto& node = nodes[i];
+                for (int c = 0; c < width; ++c) {
+                    if (node.bounds[0][c] > node.bounds[3][c])
+                        continue;
+                    aabb box = node.count[c] > 0 ? leaf_box(node.child[c], node.count[c]) : node_box(nodes[node.child[c]]);
+                    for (int a = 0; a < 3; ++a) {
+                        node.bounds[a][c] = round_down(box.min()[a]);
+                        node.bounds[3 + a][c] = round_up(box.max()[a]);
+                    }
+                }
+            }
+        }
+
+        // Expected cost of tracing a ray through the tree under the SAH. A
+        // node visit tests all children at once and counts as one traversal.
+        double sah_cost() const {
+            if (nodes.empty()) return 0;
+            double cost = 0;
+            for (const auto& node : nodes) {
+                cost += sah_traversal_cost * node_box(node).surface_area();
+                for (int c = 0; c < width; ++c)
+                    if (node.count[c] > 0)
+                        cost += sah_intersection_cost * node.count[c] * child_box(node, c).surface_area();
+            }
+            return cost / node_box(nodes[0]).surface_area();
+        }
+
+        // Same as linear_bvh::well_formed(). Unused child slots, which have
+        // inverted bounds, are never entered and are not checked.
+        bool well_formed(size_t primitive_count) const {
+            std::vector<int> depth(nodes.size(), 0);
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                const auto& node = nodes[i];
+                for (int c = 0; c < width; ++c) {
+                    if (node.count[c] > 0) {
+                        if (size_t(node.child[c]) + node.count[c] > primitive_count)
+                            return false;
+                    } else if (!(node.bounds[0][c] > node.bounds[3][c])) {
+                        uint32_t child = node.child[c];
+                        if (child <= i || child >= nodes.size() || depth[i] + 1 >= linear_bvh::max_depth)
+                            return false;
+                        depth[child] = std::max(depth[child], depth[i] + 1);
+                    }
+                }
+            }
+            return true;
+        }
+
+    public:
+        // Every level of the binary tree pushes at most width - 1 entries
+        // that are popped after the one being descended into.
+        static const int stack_size = linear_bvh::max_depth * (width - 1) + 1;
+
+        std::vector<wide_bvh_node<width>> nodes;
+        std::vector<uint32_t> indices;      // primitive order, leaves refer to ranges of it
+
+    private:
+        static aabb child_box(const wide_bvh_node<width>& node, int c) {
+            return aabb(point3(node.bounds[0][c], node.bounds[1][c], node.bounds[2][c]),
+                        point3(node.bounds[3][c], node.bounds[4][c], node.bounds[5][c]));
+        }
+
+        static aabb node_box(const wide_bvh_node<width>& node) {
+            aabb box = aabb::empty();
+            for (int c = 0; c < width; ++c)
+                box = surrounding_box(box, child_box(node, c));
+            return box;
+        }
+
+        // Appends the wide node that replaces binary node `index` and its
+        // subtree, depth first. Returns its index.
+        uint32_t collapse(const linear_bvh& binary, uint32_t index) {
+            auto wide_index = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+
+            uint32_t children[width];
+            int n = 0;
+            const auto& root = binary.nodes[index];
+            if (root.count > 0) {
+                children[n++] = index;
+            } else {
+                children[n++] = index + 1;
+                children[n++] = root.offset;
+            }
+
+            while (n < width) {
+                int largest = -1;
+                double largest_area = -1;
+                for (int c = 0; c < n; ++c) {
+                    const auto& node = binary.nodes[children[c]];
+                    if (node.count > 0)
+                        continue;
+                    double area = binary_box(node).surface_area();
+                    if (area > largest_area) {
+                        largest = c;
+                        largest_area = area;
+                    }
+                }
+                if (largest < 0)
+                    break;
+                auto opened = children[largest];
+                children[largest] = opened + 1;
+                children[n++] = binary.nodes[opened].offset;
+            }
+
+            for (int c = 0; c < width; ++c) {
+                uint32_t child = 0;
+                uint16_t count = 0;
+                float lo[3] = {INFINITY, INFINITY, INFINITY};
+                float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+                if (c < n) {
+                    const auto& node = binary.nodes[children[c]];
+                    for (int a = 0; a < 3; ++a) {
+                        lo[a] = node.bounds_min[a];
+                        hi[a] = node.bounds_max[a];
+                    }
+                    count = node.count;
+                    child = node.count > 0 ? node.offset : collapse(binary, children[c]);
+                }
+
+                auto& wide = nodes[wide_index];
+                for (int a = 0; a < 3; ++a) {
+                    wide.bounds[a][c] = lo[a];
+                    wide.bounds[3 + a][c] = hi[a];
+                }
+                wide.child[c] = child;
+                wide.count[c] = count;
+            }
+
+            for (auto& p : nodes[wide_index].pad)
+                p = 0;
+            return wide_index;
+        }
+
+        static aabb binary_box(const linear_bvh_node& node) {
+            return aabb(point3(node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]),
+                        point3(node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]));
+        }
+};
+
+typedef basic_flat_bvh<wide_bvh<4>> wide4_bvh;
+typedef basic_flat_bvh<wide_bvh<8>> wide8_bvh;
+
+#endif